@@ -0,0 +1,376 @@
+#include "btree.h"
+#include "object.h"
+#include "memory.h"
+#include <string.h>
+
+#define T   BTREE_MIN_DEGREE
+
+bool is_ordered_key(Value key) {
+    if (IS_NUMBER(key)) return AS_NUMBER(key) == AS_NUMBER(key);
+    return IS_STRING(key) || IS_SHORT_STRING(key);
+}
+
+int compare_keys(Value a, Value b) {
+    if (IS_NUMBER(a)) {
+        if (!IS_NUMBER(b)) return -1;
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return x < y ? -1 : x > y ? 1 : 0;
+    }
+    if (IS_NUMBER(b)) return 1;
+
+    // strings are interned or short, so equal strings are identical values
+    if (values_equal(a, b)) return 0;
+    char buffer_a[SHORT_STRING_BUFFER];
+    char buffer_b[SHORT_STRING_BUFFER];
+    uint32_t length_a = string_length(a);
+    uint32_t length_b = string_length(b);
+    uint32_t length = length_a < length_b ? length_a : length_b;
+    int result = memcmp(string_chars(a, buffer_a), string_chars(b, buffer_b), length);
+    if (result != 0) return result;
+    return length_a < length_b ? -1 : 1;
+}
+
+static size_t node_size(bool leaf) {
+    return sizeof(BTreeNode) + (leaf ? 0 : (BTREE_MAX_KEYS + 1) * sizeof(BTreeNode*));
+}
+
+static BTreeNode* new_node(bool leaf) {
+    BTreeNode* node = (BTreeNode*) reallocate(NULL, 0, node_size(leaf));
+    node->count = 0;
+    node->leaf = leaf;
+    return node;
+}
+
+static void free_node(BTreeNode* node) {
+    reallocate(node, node_size(node->leaf), 0);
+}
+
+static void free_tree(BTreeNode* node) {
+    if (!node->leaf) {
+        for (int i = 0; i <= node->count; i++) free_tree(node->children[i]);
+    }
+    free_node(node);
+}
+
+// index of the first key >= key, or count if there is none
+static int lower_bound(BTreeNode* node, Value key) {
+    int low = 0;
+    int high = node->count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (compare_keys(node->keys[mid], key) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static bool found_at(BTreeNode* node, int index, Value key) {
+    return index < node->count && compare_keys(node->keys[index], key) == 0;
+}
+
+// move keys and values from index on by shift places, which may be negative
+static void shift_entries(BTreeNode* node, int index, int shift) {
+    int n = node->count - index;
+    memmove(&node->keys[index + shift], &node->keys[index], n * sizeof(Value));
+    memmove(&node->values[index + shift], &node->values[index], n * sizeof(Value));
+}
+
+static void shift_children(BTreeNode* node, int index, int shift) {
+    int n = node->count + 1 - index;
+    memmove(&node->children[index + shift], &node->children[index], n * sizeof(BTreeNode*));
+}
+
+BTree::BTree() {
+    this->root = NULL;
+    this->count = 0;
+}
+
+BTree::~BTree() {
+    clear();
+}
+
+void BTree::clear() {
+    if (this->root) free_tree(this->root);
+    this->root = NULL;
+    this->count = 0;
+}
+
+bool BTree::get(Value key, Value* out_value) {
+    BTreeNode* node = this->root;
+    while (node) {
+        int i = lower_bound(node, key);
+        if (found_at(node, i, key)) {
+            if (out_value) *out_value = node->values[i];
+            return true;
+        }
+        node = node->leaf ? NULL : node->children[i];
+    }
+    return false;
+}
+
+// split the full child at index in two, moving its middle entry up into parent
+static void split_child(BTreeNode* parent, int index) {
+    BTreeNode* left = parent->children[index];
+    BTreeNode* right = new_node(left->leaf);
+
+    right->count = T - 1;
+    memcpy(right->keys, &left->keys[T], (T - 1) * sizeof(Value));
+    memcpy(right->values, &left->values[T], (T - 1) * sizeof(Value));
+    if (!left->leaf) {
+        memcpy(right->children, &left->children[T], T * sizeof(BTreeNode*));
+    }
+    left->count = T - 1;
+
+    shift_children(parent, index + 1, 1);
+    parent->children[index + 1] = right;
+    shift_entries(parent, index, 1);
+    parent->keys[index] = left->keys[T - 1];
+    parent->values[index] = left->values[T - 1];
+    parent->count++;
+}
+
+// full nodes are split on the way down, so there is always room to insert into a leaf
+bool BTree::insert(Value key, Value value) {
+    if (this->root == NULL) {
+        this->root = new_node(true);
+    } else if (this->root->count == BTREE_MAX_KEYS) {
+        BTreeNode* new_root = new_node(false);
+        new_root->children[0] = this->root;
+        this->root = new_root;
+        split_child(new_root, 0);
+    }
+
+    BTreeNode* node = this->root;
+    while (true) {
+        int i = lower_bound(node, key);
+        if (found_at(node, i, key)) {
+            node->values[i] = value;
+            return false;
+        }
+
+        if (node->leaf) {
+            shift_entries(node, i, 1);
+            node->keys[i] = key;
+            node->values[i] = value;
+            node->count++;
+            this->count++;
+            return true;
+        }
+
+        if (node->children[i]->count == BTREE_MAX_KEYS) {
+            split_child(node, i);
+            int c = compare_keys(key, node->keys[i]);
+            if (c == 0) {
+                node->values[i] = value;
+                return false;
+            }
+            if (c > 0) i++;
+        }
+        node = node->children[i];
+    }
+}
+
+// join the children either side of the entry at index, with that entry between them
+static void merge_children(BTreeNode* parent, int index) {
+    BTreeNode* left = parent->children[index];
+    BTreeNode* right = parent->children[index + 1];
+
+    left->keys[left->count] = parent->keys[index];
+    left->values[left->count] = parent->values[index];
+    memcpy(&left->keys[left->count + 1], right->keys, right->count * sizeof(Value));
+    memcpy(&left->values[left->count + 1], right->values, right->count * sizeof(Value));
+    if (!left->leaf) {
+        memcpy(&left->children[left->count + 1], right->children, (right->count + 1) * sizeof(BTreeNode*));
+    }
+    left->count += right->count + 1;
+
+    shift_entries(parent, index + 1, -1);
+    shift_children(parent, index + 2, -1);
+    parent->count--;
+    free_node(right);
+}
+
+// move an entry from the left sibling of the child at index, through the parent
+static void rotate_right(BTreeNode* parent, int index) {
+    BTreeNode* child = parent->children[index];
+    BTreeNode* sibling = parent->children[index - 1];
+
+    shift_entries(child, 0, 1);
+    if (!child->leaf) shift_children(child, 0, 1);
+    child->keys[0] = parent->keys[index - 1];
+    child->values[0] = parent->values[index - 1];
+    if (!child->leaf) child->children[0] = sibling->children[sibling->count];
+    child->count++;
+
+    parent->keys[index - 1] = sibling->keys[sibling->count - 1];
+    parent->values[index - 1] = sibling->values[sibling->count - 1];
+    sibling->count--;
+}
+
+// move an entry from the right sibling of the child at index, through the parent
+static void rotate_left(BTreeNode* parent, int index) {
+    BTreeNode* child = parent->children[index];
+    BTreeNode* sibling = parent->children[index + 1];
+
+    child->keys[child->count] = parent->keys[index];
+    child->values[child->count] = parent->values[index];
+    if (!child->leaf) child->children[child->count + 1] = sibling->children[0];
+    child->count++;
+
+    parent->keys[index] = sibling->keys[0];
+    parent->values[index] = sibling->values[0];
+    shift_entries(sibling, 1, -1);
+    if (!sibling->leaf) shift_children(sibling, 1, -1);
+    sibling->count--;
+}
+
+// make sure the child at index has at least T keys before descending into it, returning
+// the index of the child which now covers the same keys
+static int fill_child(BTreeNode* parent, int index) {
+    if (parent->children[index]->count >= T) return index;
+
+    if (index > 0 && parent->children[index - 1]->count >= T) {
+        rotate_right(parent, index);
+    } else if (index < parent->count && parent->children[index + 1]->count >= T) {
+        rotate_left(parent, index);
+    } else if (index < parent->count) {
+        merge_children(parent, index);
+    } else {
+        merge_children(parent, index - 1);
+        index--;
+    }
+    return index;
+}
+
+// every node visited other than the root has at least T keys, so a key can always be taken from it
+static bool remove_from(BTreeNode* node, Value key) {
+    while (true) {
+        int i = lower_bound(node, key);
+
+        if (found_at(node, i, key)) {
+            if (node->leaf) {
+                shift_entries(node, i + 1, -1);
+                node->count--;
+                return true;
+            }
+
+            BTreeNode* left = node->children[i];
+            BTreeNode* right = node->children[i + 1];
+            if (left->count >= T) {
+                // replace with the predecessor, then remove that from the left subtree
+                BTreeNode* pred = left;
+                while (!pred->leaf) pred = pred->children[pred->count];
+                node->keys[i] = pred->keys[pred->count - 1];
+                node->values[i] = pred->values[pred->count - 1];
+                key = node->keys[i];
+                node = left;
+            } else if (right->count >= T) {
+                BTreeNode* succ = right;
+                while (!succ->leaf) succ = succ->children[0];
+                node->keys[i] = succ->keys[0];
+                node->values[i] = succ->values[0];
+                key = node->keys[i];
+                node = right;
+            } else {
+                merge_children(node, i);
+                node = left;
+            }
+            continue;
+        }
+
+        if (node->leaf) return false;
+        node = node->children[fill_child(node, i)];
+    }
+}
+
+bool BTree::remove(Value key) {
+    if (this->root == NULL) return false;
+
+    bool found = remove_from(this->root, key);
+    if (found) this->count--;
+
+    // the root shrinks when its last entry is merged into a child, or removed from a leaf
+    if (this->root->count == 0) {
+        BTreeNode* old_root = this->root;
+        this->root = old_root->leaf ? NULL : old_root->children[0];
+        free_node(old_root);
+    }
+    return found;
+}
+
+bool BTree::floor(Value key, Value* out_key) {
+    bool found = false;
+    BTreeNode* node = this->root;
+    while (node) {
+        int i = lower_bound(node, key);
+        if (found_at(node, i, key)) {
+            *out_key = node->keys[i];
+            return true;
+        }
+        if (i > 0) {
+            *out_key = node->keys[i - 1];
+            found = true;
+        }
+        node = node->leaf ? NULL : node->children[i];
+    }
+    return found;
+}
+
+bool BTree::ceiling(Value key, Value* out_key) {
+    bool found = false;
+    BTreeNode* node = this->root;
+    while (node) {
+        int i = lower_bound(node, key);
+        if (i < node->count) {
+            *out_key = node->keys[i];
+            found = true;
+            if (compare_keys(node->keys[i], key) == 0) return true;
+        }
+        node = node->leaf ? NULL : node->children[i];
+    }
+    return found;
+}
+
+// return false once a key beyond high is reached
+static bool range_of(BTreeNode* node, Value low, Value high, ValueArray* out_keys) {
+    for (int i = lower_bound(node, low); i <= node->count; i++) {
+        if (!node->leaf && !range_of(node->children[i], low, high, out_keys)) return false;
+        if (i == node->count) break;
+        if (compare_keys(node->keys[i], high) > 0) return false;
+        out_keys->write(node->keys[i]);
+    }
+    return true;
+}
+
+void BTree::range(Value low, Value high, ValueArray* out_keys) {
+    if (this->root) range_of(this->root, low, high, out_keys);
+}
+
+static void keys_of(BTreeNode* node, ValueArray* out_keys) {
+    for (int i = 0; i <= node->count; i++) {
+        if (!node->leaf) keys_of(node->children[i], out_keys);
+        if (i < node->count) out_keys->write(node->keys[i]);
+    }
+}
+
+void BTree::keys(ValueArray* out_keys) {
+    if (this->root) keys_of(this->root, out_keys);
+}
+
+static void mark_node(BTreeNode* node) {
+    for (int i = 0; i < node->count; i++) {
+        mark_value(node->keys[i]);
+        mark_value(node->values[i]);
+    }
+    if (!node->leaf) {
+        for (int i = 0; i <= node->count; i++) mark_node(node->children[i]);
+    }
+}
+
+void BTree::mark_objects() {
+    if (this->root) mark_node(this->root);
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.h"
+#include "value.h"
+
+// nodes hold between BTREE_MIN_DEGREE - 1 and 2 * BTREE_MIN_DEGREE - 1 keys, except the root
+#define BTREE_MIN_DEGREE    16
+#define BTREE_MAX_KEYS      (2 * BTREE_MIN_DEGREE - 1)
+
+// keys and values are kept in separate arrays, so that searching a node only reads its keys
+// leaves are allocated without the children array
+struct BTreeNode {
+    int count;
+    bool leaf;
+    Value keys[BTREE_MAX_KEYS];
+    Value values[BTREE_MAX_KEYS];
+    BTreeNode* children[];
+};
+
+// true for keys which can be ordered: numbers other than NaN, and strings
+bool is_ordered_key(Value key);
+
+// numbers sort before strings, which sort by their bytes
+int compare_keys(Value a, Value b);
+
+// B-tree mapping ordered keys to values
+struct BTree {
+    BTree();
+    ~BTree();
+
+    void clear();
+
+    bool get(Value key, Value* out_value);          // return true if key found
+    bool insert(Value key, Value value);            // return true if key not found, always inserts or overwrites
+    bool remove(Value key);                         // return true if key found and removed
+
+    bool floor(Value key, Value* out_key);          // greatest key <= key, return true if there is one
+    bool ceiling(Value key, Value* out_key);        // least key >= key, return true if there is one
+    void range(Value low, Value high, ValueArray* out_keys);  // keys from low to high inclusive, in order
+    void keys(ValueArray* out_keys);                // all keys in order
+
+    void mark_objects();
+
+    int get_count() { return count; }
+
+private:
+    BTreeNode* root;
+    int count;
+};
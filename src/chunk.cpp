@@ -1,6 +1,7 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include <assert.h>
 
 Chunk::Chunk() {
@@ -8,11 +9,15 @@ Chunk::Chunk() {
     this->lines = NULL;
     this->capacity = 0;
     this->length = 0;
+    this->caches = NULL;
+    this->cache_count = 0;
 }
 
 Chunk::~Chunk() {
     if (this->code)
         FREE_ARRAY(uint8_t, this->code, this->capacity);
+    if (this->caches)
+        FREE_ARRAY(InlineCache, this->caches, 256);
 
     this->code = NULL;
     this->lines = NULL;
@@ -78,3 +83,113 @@ int Chunk::add_constant_value(Value value) {
     this->constants.write(value);
     return length;
 }
+
+// caches are addressed by an 8-bit operand, so allocate all 256 at once
+int Chunk::add_inline_cache(int constant) {
+    if (this->cache_count >= 256) return -1;
+    if (this->caches == NULL) {
+        this->caches = ALLOC_ARRAY(InlineCache, 256);
+    }
+
+    InlineCache* cache = &this->caches[this->cache_count];
+    cache->constant = constant;
+    cache->klass = NULL;
+    cache->method = NIL_VAL;
+    return this->cache_count++;
+}
+
+void Chunk::mark_objects() {
+    this->constants.mark_objects();
+    for (int i = 0; i < this->cache_count; i++) {
+        mark_object((Obj*) this->caches[i].klass);
+        mark_value(this->caches[i].method);
+    }
+}
+
+// length in bytes of the instruction at offset, including operands
+int Chunk::instruction_length(int offset) {
+    assert(offset < this->length);
+    uint8_t inst = this->code[offset];
+
+    switch (inst) {
+    case OP_CONSTANT:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_POPN:
+    case OP_CALL:
+    case OP_LIST:
+    case OP_BUILD_STRING:
+        return 2;
+
+    case OP_CONSTANT_16:
+    case OP_CLASS_16:
+    case OP_METHOD_16:
+    case OP_DEFINE_GLOBAL_16:
+    case OP_GET_GLOBAL_16:
+    case OP_SET_GLOBAL_16:
+    case OP_GET_LOCAL_16:
+    case OP_SET_LOCAL_16:
+    case OP_GET_UPVALUE_16:
+    case OP_SET_UPVALUE_16:
+    case OP_GET_PROPERTY_16:
+    case OP_SET_PROPERTY_16:
+    case OP_GET_SUPER_16:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+        return 3;
+
+    case OP_CONSTANT_24:
+    case OP_CLASS_24:
+    case OP_METHOD_24:
+    case OP_DEFINE_GLOBAL_24:
+    case OP_GET_GLOBAL_24:
+    case OP_SET_GLOBAL_24:
+    case OP_GET_LOCAL_24:
+    case OP_SET_LOCAL_24:
+    case OP_GET_UPVALUE_24:
+    case OP_SET_UPVALUE_24:
+    case OP_GET_PROPERTY_24:
+    case OP_SET_PROPERTY_24:
+    case OP_GET_SUPER_24:
+        return 4;
+
+    case OP_INVOKE:
+    case OP_INVOKE_SUPER:
+    case OP_INVOKE_CACHED:
+        return 3;
+    case OP_INVOKE_16:
+    case OP_INVOKE_SUPER_16:
+        return 4;
+    case OP_INVOKE_24:
+    case OP_INVOKE_SUPER_24:
+        return 5;
+
+    case OP_INTRINSIC:
+        return 3;
+
+    case OP_CLOSURE:
+    case OP_CLOSURE_16:
+    case OP_CLOSURE_24: {
+        int width = inst - OP_CLOSURE + 1;
+        int constant = this->code[offset + 1];
+        if (width > 1) constant |= this->code[offset + 2] << 8;
+        if (width > 2) constant |= this->code[offset + 3] << 16;
+        ObjFunction* fn = AS_FUNCTION(this->constants.values[constant]);
+        return 1 + width + 2 * fn->upvalue_count;
+    }
+
+    default:
+        return 1;
+    }
+}
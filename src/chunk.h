@@ -86,6 +86,14 @@ enum OpCode {
     OP_NEGATE,
     OP_NOT,
 
+    // unchecked variants, for operands known to be numbers
+    OP_ADD_NN,
+    OP_SUBTRACT_NN,
+    OP_MULTIPLY_NN,
+    OP_DIVIDE_NN,
+    OP_LESS_NN,
+    OP_GREATER_NN,
+
     OP_POP,
     OP_POPN,
     OP_PRINT,
@@ -96,6 +104,25 @@ enum OpCode {
     OP_CALL,
     OP_CLOSE_UPVALUE,
     OP_INHERIT,
+    OP_INTRINSIC,
+    OP_LIST,
+    OP_INDEX_GET,
+    OP_INDEX_SET,
+    OP_BUILD_STRING,
+
+    // only produced by the optimizer
+    OP_NOP,
+    OP_DUP,
+    OP_INVOKE_CACHED,
+};
+
+struct ObjClass;
+
+// monomorphic cache for a method invocation site
+struct InlineCache {
+    int constant;       // method name, as index into constants
+    ObjClass* klass;    // receiver class, or NULL until first use
+    Value method;
 };
 
 struct Chunk {
@@ -107,10 +134,15 @@ struct Chunk {
 
     void write_variable_length_opcode(OpCode base_op, int index, int line);
     int add_constant_value(Value value);
+    int add_inline_cache(int constant);  // return cache index, or -1 when full
+    int instruction_length(int offset);
+    void mark_objects();
 
     uint8_t* code;
     int* lines;
     int capacity;
     int length;
     ValueArray constants;
+    InlineCache* caches;
+    int cache_count;
 };
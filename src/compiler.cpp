@@ -5,14 +5,20 @@
 
 #include <stdlib.h>     // strtod
 #include <string.h>     // memcmp
+#include <math.h>       // signbit
 #include <assert.h>
 
 #include "debug.h"
 
 #define MAX_CONSTANTS       256     // architecture limits these to 16777215   (24-bits)
 #define MAX_LOCALS          256     // architecture limits these to 32767      (15-bits)
-#define MAX_UPVALUES        256     // (two bytes, with one bit used to distinguish between local vs upvalue)
+#define MAX_UPVALUES        256     // (two bytes, with two bits used to distinguish between local, copied local, or upvalue)
+#define MAX_CAPTURE_REFS    256     // only a compiler limit, further captures are always boxed
 #define MAX_BREAK_STMTS     64      // only a compiler limit
+#define MAX_TYPED_LOCALS    512     // only a compiler limit, locals beyond this are never typed as numbers
+#define MAX_NUMBER_SITES    512     // only a compiler limit, further sites use checked opcodes
+#define MAX_TYPE_EDGES      512     // only a compiler limit
+#define MAX_TYPE_DEPS       4
 
 enum Precedence {
     PREC_NONE,
@@ -48,6 +54,52 @@ struct Local {
     Token name;
     int depth;
     bool is_captured;
+    bool is_reassigned; // assigned anywhere after its declaration
+    bool is_boxed;      // some references to it were not recorded, so stay boxed
+    bool is_const;      // declared with 'const', so may never be reassigned
+    bool has_value;     // const initialized with a value known at compile-time
+    Value value;
+    int type_id;        // index into Compiler::typed_locals, or -1 when never known to be a number
+};
+
+// Local type inference
+//
+// The compiler speculates that a local holds a number when it is initialized with a number,
+// and emits unchecked opcodes like OP_ADD_NN when both operands are known to be numbers.
+// Since we compile in a single pass, a later assignment may still store a non-number.
+// That 'pollutes' the local: every unchecked opcode that depended on it is patched back to
+// its checked form, and so is every local whose number-ness depended on it.
+// Locals assigned from within closures are polluted, since that may happen at any time.
+
+struct ExprType {
+    bool is_number;
+    int dep_count;
+    int deps[MAX_TYPE_DEPS];    // typed locals which must remain numbers for is_number to hold
+
+    // value known at compile-time, when the expression was compiled to a single push from start to end
+    bool is_constant;
+    Value constant;
+    int start;
+    int end;
+
+    // name of a global, when the expression was compiled to a single OP_GET_GLOBAL from start to end
+    int global;
+};
+
+struct TypedLocal {
+    bool polluted;
+};
+
+struct NumberSite {
+    int offset;
+    uint8_t checked_op;
+    int dep_count;
+    int deps[MAX_TYPE_DEPS];
+};
+
+struct TypeEdge {
+    int from;   // when this typed local is polluted
+    int to;     // then so is this one
 };
 
 struct Upvalue {
@@ -55,6 +107,20 @@ struct Upvalue {
     bool is_local;
 };
 
+// Flat closures
+//
+// A captured local which is never reassigned can't be observed to change, so closures
+// copy its value directly, instead of sharing a heap-allocated ObjUpvalue box.
+// Since we compile in a single pass, a closure may be created before an assignment
+// to the local is seen.  So every upvalue reference to a local is emitted as boxed,
+// and its location recorded.  When the local goes out of scope, all assignments to
+// it are known, and the references are patched to copy it when it was never reassigned.
+
+struct CaptureRef {
+    int local;
+    int offset;     // of the upvalue reference, following OP_CLOSURE
+};
+
 struct LoopContext {
     int scope_depth;
     int loop_start;
@@ -71,6 +137,16 @@ struct Compiler {
     int upvalue_count;
     Local locals[MAX_LOCALS];
     Upvalue upvalues[MAX_UPVALUES];
+
+    int capture_ref_count;
+    CaptureRef capture_refs[MAX_CAPTURE_REFS];
+
+    int typed_local_count;
+    int number_site_count;
+    int type_edge_count;
+    TypedLocal typed_locals[MAX_TYPED_LOCALS];
+    NumberSite number_sites[MAX_NUMBER_SITES];
+    TypeEdge type_edges[MAX_TYPE_EDGES];
 };
 
 struct ClassCompiler {
@@ -85,6 +161,7 @@ static void binary(bool lvalue);
 static void number(bool lvalue);
 static void literal(bool lvalue);
 static void string(bool lvalue);
+static void interpolation(bool lvalue);
 static void variable(bool lvalue);
 static void function(bool lvalue);
 static void this_(bool lavalue);
@@ -93,6 +170,8 @@ static void and_(bool lvalue);
 static void or_(bool lvalue);
 static void call(bool lvalue);
 static void dot(bool lvalue);
+static void list(bool lvalue);
+static void subscript(bool lvalue);
 
 
 static ParseRule rules[] = {
@@ -103,6 +182,8 @@ static ParseRule rules[] = {
     [TOKEN_RIGHT_PAREN]     = {NULL,     NULL,   PREC_NONE},
     [TOKEN_LEFT_BRACE]      = {NULL,     NULL,   PREC_NONE},
     [TOKEN_RIGHT_BRACE]     = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_LEFT_BRACKET]    = {list,     subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET]   = {NULL,     NULL,   PREC_NONE},
     [TOKEN_COMMA]           = {NULL,     NULL,   PREC_NONE},
     [TOKEN_DOT]             = {NULL,     dot,    PREC_CALL},
     [TOKEN_MINUS]           = {unary,    binary, PREC_TERM},
@@ -122,11 +203,13 @@ static ParseRule rules[] = {
 
     [TOKEN_IDENTIFIER]      = {variable, NULL,   PREC_NONE},
     [TOKEN_STRING]          = {string,   NULL,   PREC_NONE},
+    [TOKEN_INTERPOLATION]   = {interpolation, NULL, PREC_NONE},
     [TOKEN_NUMBER]          = {number,   NULL,   PREC_NONE},
 
     [TOKEN_AND]             = {NULL,     and_,   PREC_AND},
     [TOKEN_BREAK]           = {NULL,     NULL,   PREC_NONE},
     [TOKEN_CLASS]           = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_CONST]           = {NULL,     NULL,   PREC_NONE},
     [TOKEN_CONTINUE]        = {NULL,     NULL,   PREC_NONE},
     [TOKEN_ELSE]            = {NULL,     NULL,   PREC_NONE},
     [TOKEN_FALSE]           = {literal,  NULL,   PREC_NONE},
@@ -150,6 +233,12 @@ static Parser parser;
 static VM *compiling_vm;
 static Compiler* current;
 static ClassCompiler* current_class;
+static ExprType last_type;      // type of the most recently compiled expression
+static Table declared_globals;  // names of globals declared so far in this compile
+
+// constants declared in this compile, only given to the VM once it succeeds
+static Table pending_constant_names;
+static Table pending_constant_values;
 
 // synthetic tokens for 'this' and 'super'
 static Token this_token  = { TOKEN_THIS,  "this",  4, 0 };
@@ -163,6 +252,14 @@ static int here() {
     return current_chunk()->length;
 }
 
+static bool is_constant_global(ObjString* name) {
+    return pending_constant_names.get(name, NULL) || compiling_vm->is_constant_global(name);
+}
+
+static bool get_constant_global(ObjString* name, Value* value) {
+    return pending_constant_values.get(name, value) || compiling_vm->get_constant_global(name, value);
+}
+
 static void emit_byte(uint8_t byte, int line) {
     current_chunk()->write(byte, line);
 }
@@ -182,6 +279,22 @@ static int emit_constant(Value value) {
     return index;
 }
 
+// push a value known at compile-time
+// returns false without emitting anything, when no more constants can be added
+static bool emit_constant_value(Value value, int line) {
+    if (IS_NIL(value)) {
+        emit_byte(OP_NIL, line);
+    } else if (IS_BOOL(value)) {
+        emit_byte(AS_BOOL(value) ? OP_TRUE : OP_FALSE, line);
+    } else if (current_chunk()->constants.length >= MAX_CONSTANTS) {
+        return false;
+    } else {
+        int index = current_chunk()->add_constant_value(value);
+        current_chunk()->write_variable_length_opcode(OP_CONSTANT, index, line);
+    }
+    return true;
+}
+
 static int emit_closure(Value value) {
     assert(IS_FUNCTION(value));
     if (current_chunk()->constants.length >= MAX_CONSTANTS) {
@@ -194,7 +307,8 @@ static int emit_closure(Value value) {
 }
 
 static void emit_upvalue_ref(int index, bool is_local, int line) {
-    // encode as 15-bit index, with high bit indicating local vs upvalue
+    // encode as 14-bit index, with high bit indicating local vs upvalue
+    // the next bit is patched later by flatten_captures(), when a local can be copied
     uint16_t word = index;
     if (is_local) word |= 0x8000;
     emit_bytes(word & 0xFF, word >> 8, line);
@@ -347,6 +461,11 @@ static bool declare_local(Token* token) {
     local->name = *token;
     local->depth = -1;  // declare only - set to scope_depth later in define_local()
     local->is_captured = false;
+    local->is_reassigned = false;
+    local->is_boxed = false;
+    local->is_const = false;
+    local->has_value = false;
+    local->type_id = -1;
     return true;
 }
 
@@ -360,6 +479,210 @@ static void define_local(int index) {
     local->depth = current->scope_depth;
 }
 
+//
+// Types
+//
+
+static ExprType unknown_type() {
+    ExprType type;
+    type.is_number = false;
+    type.dep_count = 0;
+    type.is_constant = false;
+    type.global = -1;
+    return type;
+}
+
+static ExprType number_type() {
+    ExprType type;
+    type.is_number = true;
+    type.dep_count = 0;
+    type.is_constant = false;
+    type.global = -1;
+    return type;
+}
+
+// constant value, whose code started at the given offset, and ends here
+static ExprType constant_type(Value value, int start) {
+    ExprType type = IS_NUMBER(value) ? number_type() : unknown_type();
+    type.is_constant = true;
+    type.constant = value;
+    type.start = start;
+    type.end = here();
+    return type;
+}
+
+// number whose type depends on both a and b
+// returns unknown when either is unknown, or when there are too many dependencies to track
+static ExprType merge_types(ExprType* a, ExprType* b) {
+    if (!a->is_number || !b->is_number) return unknown_type();
+
+    ExprType type = *a;
+    for (int i = 0; i < b->dep_count; i++) {
+        bool found = false;
+        for (int j = 0; j < type.dep_count; j++) {
+            if (type.deps[j] == b->deps[i]) found = true;
+        }
+        if (found) continue;
+        if (type.dep_count >= MAX_TYPE_DEPS) return unknown_type();
+        type.deps[type.dep_count++] = b->deps[i];
+    }
+    return type;
+}
+
+static bool type_is_number(Compiler* compiler, ExprType* type) {
+    if (!type->is_number) return false;
+    for (int i = 0; i < type->dep_count; i++) {
+        if (compiler->typed_locals[type->deps[i]].polluted) return false;
+    }
+    return true;
+}
+
+// mark a typed local as possibly holding a non-number
+// reverts all unchecked opcodes depending on it, and pollutes dependent locals
+static void pollute_local(Compiler* compiler, int type_id) {
+    if (type_id < 0) return;
+    TypedLocal* typed = &compiler->typed_locals[type_id];
+    if (typed->polluted) return;
+    typed->polluted = true;
+
+    uint8_t* code = compiler->fn->chunk.code;
+    for (int i = 0; i < compiler->number_site_count; i++) {
+        NumberSite* site = &compiler->number_sites[i];
+        for (int d = 0; d < site->dep_count; d++) {
+            if (site->deps[d] == type_id) {
+                code[site->offset] = site->checked_op;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < compiler->type_edge_count; i++) {
+        TypeEdge* edge = &compiler->type_edges[i];
+        if (edge->from == type_id) {
+            pollute_local(compiler, edge->to);
+        }
+    }
+}
+
+// record that the local with type_id was assigned a value of the given type
+static void assign_type(Compiler* compiler, int type_id, ExprType* type) {
+    if (type_id < 0) return;
+    if (!type_is_number(compiler, type)) {
+        return pollute_local(compiler, type_id);
+    }
+
+    for (int i = 0; i < type->dep_count; i++) {
+        if (type->deps[i] == type_id) continue;
+        if (compiler->type_edge_count >= MAX_TYPE_EDGES) {
+            return pollute_local(compiler, type_id);
+        }
+        TypeEdge* edge = &compiler->type_edges[compiler->type_edge_count++];
+        edge->from = type->deps[i];
+        edge->to = type_id;
+    }
+}
+
+// start tracking the type of a local, given the type of its initial value
+static void type_local(Local* local, ExprType* type) {
+    if (current->typed_local_count >= MAX_TYPED_LOCALS) return;
+    if (!type_is_number(current, type)) return;
+
+    local->type_id = current->typed_local_count++;
+    current->typed_locals[local->type_id].polluted = false;
+    assign_type(current, local->type_id, type);
+}
+
+// emit an unchecked numeric opcode when type is known to be a number, otherwise the checked one
+static void emit_number_op(OpCode checked_op, OpCode unchecked_op, ExprType* type, int line) {
+    if (!type_is_number(current, type) || current->number_site_count >= MAX_NUMBER_SITES) {
+        emit_byte(checked_op, line);
+        return;
+    }
+
+    NumberSite* site = &current->number_sites[current->number_site_count++];
+    site->offset = here();
+    site->checked_op = checked_op;
+    site->dep_count = type->dep_count;
+    memcpy(site->deps, type->deps, type->dep_count * sizeof(int));
+    emit_byte(unchecked_op, line);
+}
+
+//
+// Constant folding
+//
+// Operators applied to values known at compile-time are evaluated by the compiler,
+// replacing the code of the whole expression with a single push of the result.
+// This includes uses of constants with known values.
+//
+
+// true when type is a constant whose push ends at the given offset, and so may be replaced
+static bool is_constant_at(ExprType* type, int end) {
+    return type->is_constant && type->end == end;
+}
+
+// replace the code from start up to here with a push of the given value
+static void fold_constant(Value value, int start, int line) {
+    int end = here();
+    current_chunk()->length = start;
+    if (!emit_constant_value(value, line)) {
+        // nothing was written, so keep the original code
+        current_chunk()->length = end;
+        last_type = unknown_type();
+        return;
+    }
+    last_type = constant_type(value, start);
+}
+
+// numbers that can be distinguished when added to the constant table
+static bool fold_number(double number, Value* result) {
+    if (number == 0 && signbit(number)) return false;  // -0 is equal to 0
+    *result = NUMBER_VAL(number);
+    return true;
+}
+
+static bool fold_unary(TokenType op_type, Value a, Value* result) {
+    switch (op_type) {
+        case TOKEN_MINUS:   return IS_NUMBER(a) && fold_number(-AS_NUMBER(a), result);
+        case TOKEN_BANG:    *result = BOOL_VAL(!is_truthy(a)); return true;
+        default:            return false;
+    }
+}
+
+// returns false for operands which may only fail at runtime
+static bool fold_binary(TokenType op_type, Value a, Value b, Value* result) {
+    switch (op_type) {
+        case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(values_equal(a, b)); return true;
+        case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!values_equal(a, b)); return true;
+        default: break;
+    }
+
+    if (op_type == TOKEN_PLUS && is_string_like(a) && is_string_like(b)) {
+        // constants are always interned
+        *result = concatenate_strings(compiling_vm, a, b);
+        if (IS_STRING(*result)) *result = OBJ_VAL(intern_string(compiling_vm, AS_STRING(*result)));
+        return !IS_NIL(*result);
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+
+    switch (op_type) {
+        case TOKEN_PLUS:            return fold_number(x + y, result);
+        case TOKEN_MINUS:           return fold_number(x - y, result);
+        case TOKEN_STAR:            return fold_number(x * y, result);
+        case TOKEN_SLASH:           return fold_number(x / y, result);
+
+        // same as the emitted opcodes, including for NaN
+        case TOKEN_LESS:            *result = BOOL_VAL(x < y); return true;
+        case TOKEN_LESS_EQUAL:      *result = BOOL_VAL(!(x > y)); return true;
+        case TOKEN_GREATER:         *result = BOOL_VAL(x > y); return true;
+        case TOKEN_GREATER_EQUAL:   *result = BOOL_VAL(!(x < y)); return true;
+
+        default: return false;
+    }
+}
+
 // define an upvalue reference to a variable at given index
 // pass is_local true if it's in the immediately enclosing scope
 // checks for duplicates.  returns upvalue index
@@ -401,6 +724,19 @@ static int resolve_local(Compiler* compiler, Token* name) {
     return -1;
 }
 
+// lookup a local variable by name in enclosing functions, as would be found by resolve_upvalue()
+// returns NULL if not found
+static Local* resolve_outer_local(Compiler* compiler, Token* name) {
+    for (Compiler* c = compiler->parent; c != NULL; c = c->parent) {
+        for (int i = c->local_count - 1; i >= 0; i--) {
+            if (identifiers_equal(&c->locals[i].name, name)) {
+                return &c->locals[i];
+            }
+        }
+    }
+    return NULL;
+}
+
 // recursively lookup an upvalue variable by name
 // return a non-negative upvalue index on success, and -1 if not found as available upvalue
 static int resolve_upvalue(Compiler* compiler, Token* name) {
@@ -422,13 +758,62 @@ static int resolve_upvalue(Compiler* compiler, Token* name) {
     return -1;
 }
 
+// mark the local ultimately referred to by an upvalue as reassigned
+static void reassign_upvalue(Compiler* compiler, int index) {
+    Upvalue* upvalue = &compiler->upvalues[index];
+    while (!upvalue->is_local) {
+        compiler = compiler->parent;
+        upvalue = &compiler->upvalues[upvalue->index];
+    }
+
+    Local* local = &compiler->parent->locals[upvalue->index];
+    local->is_reassigned = true;
+    pollute_local(compiler->parent, local->type_id);
+}
+
+// record the location of an upvalue reference to a local, so it may be patched later
+static void record_capture(int local, int offset) {
+    if (current->capture_ref_count >= MAX_CAPTURE_REFS) {
+        // the reference stays boxed, so the box must still be closed when the local goes
+        current->locals[local].is_boxed = true;
+        return;
+    }
+    CaptureRef* ref = &current->capture_refs[current->capture_ref_count++];
+    ref->local = local;
+    ref->offset = offset;
+}
+
+// patch references to locals at or above first_local, which are about to go out of scope,
+// so closures copy them when never reassigned.  forgets those references, as slots are reused
+static void flatten_captures(int first_local) {
+    int kept = 0;
+    for (int i=0; i < current->capture_ref_count; i++) {
+        CaptureRef* ref = &current->capture_refs[i];
+        if (ref->local < first_local) {
+            current->capture_refs[kept++] = *ref;
+        } else if (!current->locals[ref->local].is_reassigned) {
+            current_chunk()->code[ref->offset + 1] |= 0x40;
+        }
+    }
+    current->capture_ref_count = kept;
+}
+
 // returns true on success, false with error
 static bool declare_variable() {
-    // nothing to do in global scope, and always allowed to redeclare a new global
-    if (current->scope_depth <= 0) return true;
-
     Token* name = &parser.previous;
 
+    // nothing to do in global scope, and always allowed to redeclare a new global, unless constant
+    if (current->scope_depth <= 0) {
+        Value name_string = string_value(compiling_vm, name->start, name->length);
+        if (IS_NIL(name_string)) return true;
+        if (is_constant_global(AS_STRING(name_string))) {
+            parser.error("Already a constant with this name.");
+            return false;
+        }
+        declared_globals.insert(AS_STRING(name_string), NIL_VAL);
+        return true;
+    }
+
     // check if already declared in local scope
     for (int i = current->local_count - 1; i >= 0; i--) {
         Local* local = &current->locals[i];
@@ -474,14 +859,16 @@ static void begin_scope() {
 // used to break out of loop, without actually updating scope_depth or local_count
 //
 // when capture_locals is true, emit OP_CLOSE_UPVALUE instead of OP_POP for locals
-// that have been marked with is_captured
+// that have been marked with is_captured, and are boxed because they are reassigned, or because
+// their references could not all be recorded
 static int pop_scope_to(int scope_depth, int line, bool capture_locals) {
     int l = current->local_count;
     int total_locals_to_pop = 0;
     int locals_to_pop = 0;
 
     while (l > 0 && current->locals[l-1].depth > scope_depth) {
-        if (capture_locals && current->locals[l-1].is_captured) {
+        Local* local = &current->locals[l-1];
+        if (capture_locals && local->is_captured && (local->is_reassigned || local->is_boxed)) {
             if (locals_to_pop > 0) {
                 emit_pop_count(locals_to_pop, line);
                 locals_to_pop = 0;
@@ -506,6 +893,7 @@ static void end_scope() {
     assert(current->scope_depth > 0);
     current->scope_depth--;
     current->local_count -= pop_scope_to(current->scope_depth, parser.line(), true);
+    flatten_captures(current->local_count);
 }
 
 
@@ -532,6 +920,17 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
     local->name.line = 0;
     local->depth = 0;
     local->is_captured = false;
+    local->is_reassigned = false;
+    local->is_boxed = false;
+    local->is_const = false;
+    local->has_value = false;
+    local->type_id = -1;
+
+    compiler->upvalue_count = 0;
+    compiler->capture_ref_count = 0;
+    compiler->typed_local_count = 0;
+    compiler->number_site_count = 0;
+    compiler->type_edge_count = 0;
 
     switch (type) {
         case TYPE_METHOD:
@@ -553,8 +952,33 @@ static void init_compiler(Compiler* compiler, FunctionType type) {
     }
 }
 
+// recognize bodies the VM can execute without pushing a frame
+static void detect_inline_kind(ObjFunction* fn, FunctionType type) {
+    Chunk* chunk = &fn->chunk;
+    uint8_t* code = chunk->code;
+
+    if (type == TYPE_METHOD && fn->arity == 0 && chunk->length == 5 &&
+        code[0] == OP_GET_LOCAL && code[1] == 0 && code[2] == OP_GET_PROPERTY && code[4] == OP_RETURN) {
+        fn->inline_kind = INLINE_GETTER;
+        fn->inline_value = chunk->constants.values[code[3]];
+    } else if (type == TYPE_INITIALIZER && chunk->length == 3 &&
+        code[0] == OP_GET_LOCAL && code[1] == 0 && code[2] == OP_RETURN) {
+        fn->inline_kind = INLINE_RECEIVER;
+    } else if (type != TYPE_SCRIPT && type != TYPE_INITIALIZER && chunk->length == 2 && code[1] == OP_RETURN &&
+        (code[0] == OP_NIL || code[0] == OP_TRUE || code[0] == OP_FALSE)) {
+        fn->inline_kind = INLINE_CONSTANT;
+        fn->inline_value = code[0] == OP_NIL ? NIL_VAL : BOOL_VAL(code[0] == OP_TRUE);
+    } else if (type != TYPE_SCRIPT && type != TYPE_INITIALIZER && chunk->length == 3 &&
+        code[0] == OP_CONSTANT && code[2] == OP_RETURN) {
+        fn->inline_kind = INLINE_CONSTANT;
+        fn->inline_value = chunk->constants.values[code[1]];
+    }
+}
+
 static ObjFunction* end_compiler() {
     emit_return(parser.line());
+    flatten_captures(0);
+    detect_inline_kind(current->fn, current->type);
 
     if (compiling_vm->is_debug_mode() && !parser.had_error()) {
         const char* name = current->fn->name ? current->fn->name->chars : "<script>";
@@ -587,6 +1011,7 @@ static void expr_precedence(Precedence precedence) {
     parser.advance();
     ParseFn prefix_rule = get_rule(parser.previous.type)->prefix;
     if (!prefix_rule) return parser.error("Expect expression.");
+    last_type = unknown_type();
     prefix_rule(lvalue);
 
     while (precedence <= get_rule(parser.current.type)->precedence) {
@@ -606,29 +1031,63 @@ static void expression() {
 }
 
 static void number(bool _lvalue) {
+    int start = here();
     double value = strtod(parser.previous.start, NULL);
     emit_constant(NUMBER_VAL(value));
+    last_type = constant_type(NUMBER_VAL(value), start);
 }
 
 static void literal(bool _lvalue) {
+    int start = here();
     int line = parser.line();
     TokenType op_type = parser.previous.type;
 
     switch (op_type) {
-        case TOKEN_NIL:     emit_byte(OP_NIL, line); break;
-        case TOKEN_FALSE:   emit_byte(OP_FALSE, line); break;
-        case TOKEN_TRUE:    emit_byte(OP_TRUE, line); break;
+        case TOKEN_NIL:     emit_byte(OP_NIL, line); last_type = constant_type(NIL_VAL, start); break;
+        case TOKEN_FALSE:   emit_byte(OP_FALSE, line); last_type = constant_type(BOOL_VAL(false), start); break;
+        case TOKEN_TRUE:    emit_byte(OP_TRUE, line); last_type = constant_type(BOOL_VAL(true), start); break;
 
         default: return parser.error("unreachable literal");
     }
 }
 
 static void string(bool _lvalue) {
+    int start = here();
     const char* str = parser.previous.start + 1;    // skip opening "
     int length = parser.previous.length - 2;        // without opening and closing ""
-    Value val = string_value(compiling_vm, str, length);
+    Value val = make_string(compiling_vm, str, length);
     if (IS_NIL(val)) return parser.error("String too long.");
     emit_constant(val);
+    last_type = constant_type(val, start);
+}
+
+// "a${b}c" pushes "a", b and "c", which OP_BUILD_STRING then joins in a single string
+static void interpolation(bool _lvalue) {
+    int line = parser.line();
+    int count = 0;
+    do {
+        // text before ${, skipping the opening " or the } ending the previous expression
+        if (parser.previous.length > 3) {
+            Value val = make_string(compiling_vm, parser.previous.start + 1, parser.previous.length - 3);
+            if (IS_NIL(val)) return parser.error("String too long.");
+            emit_constant(val);
+            count++;
+        }
+        expression();
+        count++;
+    } while (parser.match(TOKEN_INTERPOLATION));
+
+    parser.consume(TOKEN_STRING, "Expect '}' after interpolated expression.");
+    if (parser.previous.length > 2) {
+        Value val = make_string(compiling_vm, parser.previous.start + 1, parser.previous.length - 2);
+        if (IS_NIL(val)) return parser.error("String too long.");
+        emit_constant(val);
+        count++;
+    }
+
+    if (count > 255) return parser.error("Can't have more than 255 parts in an interpolated string.");
+    emit_bytes(OP_BUILD_STRING, count, line);
+    last_type = unknown_type();
 }
 
 static void grouping(bool _lvalue) {
@@ -642,9 +1101,14 @@ static void unary(bool _lvalue) {
 
     expr_precedence(PREC_UNARY);
 
+    Value result;
+    if (is_constant_at(&last_type, here()) && fold_unary(op_type, last_type.constant, &result)) {
+        return fold_constant(result, last_type.start, line);
+    }
+
     switch (op_type) {
-        case TOKEN_MINUS:   emit_byte(OP_NEGATE, line); break;
-        case TOKEN_BANG:    emit_byte(OP_NOT, line); break;
+        case TOKEN_MINUS:   emit_byte(OP_NEGATE, line); last_type = number_type(); break;
+        case TOKEN_BANG:    emit_byte(OP_NOT, line); last_type = unknown_type(); break;
         case TOKEN_PLUS:    break;  // NOP
 
         default: return parser.error("unreachable unary operator");
@@ -655,25 +1119,44 @@ static void binary(bool _lvalue) {
     int line = parser.line();
     TokenType op_type = parser.previous.type;
     ParseRule* rule = get_rule(op_type);
+    ExprType left_type = last_type;
+    int left_end = here();
 
     Precedence next_prec = (Precedence) (rule->precedence + 1);  // left-associative
     expr_precedence(next_prec);
 
+    Value result;
+    if (is_constant_at(&left_type, left_end) && is_constant_at(&last_type, here()) && last_type.start == left_end &&
+        fold_binary(op_type, left_type.constant, last_type.constant, &result)) {
+        return fold_constant(result, left_type.start, line);
+    }
+
+    ExprType type = merge_types(&left_type, &last_type);
+
     switch (op_type) {
-        case TOKEN_PLUS:    emit_byte(OP_ADD, line); break;
-        case TOKEN_MINUS:   emit_byte(OP_SUBTRACT, line); break;
-        case TOKEN_STAR:    emit_byte(OP_MULTIPLY, line); break;
-        case TOKEN_SLASH:   emit_byte(OP_DIVIDE, line); break;
+        case TOKEN_PLUS:    emit_number_op(OP_ADD, OP_ADD_NN, &type, line); break;
+        case TOKEN_MINUS:   emit_number_op(OP_SUBTRACT, OP_SUBTRACT_NN, &type, line); break;
+        case TOKEN_STAR:    emit_number_op(OP_MULTIPLY, OP_MULTIPLY_NN, &type, line); break;
+        case TOKEN_SLASH:   emit_number_op(OP_DIVIDE, OP_DIVIDE_NN, &type, line); break;
 
         case TOKEN_BANG_EQUAL:      emit_bytes(OP_EQUAL, OP_NOT, line); break;
         case TOKEN_EQUAL_EQUAL:     emit_byte(OP_EQUAL, line); break;
-        case TOKEN_LESS:            emit_byte(OP_LESS, line); break;
-        case TOKEN_LESS_EQUAL:      emit_bytes(OP_GREATER, OP_NOT, line); break;
-        case TOKEN_GREATER:         emit_byte(OP_GREATER, line); break;
-        case TOKEN_GREATER_EQUAL:   emit_bytes(OP_LESS, OP_NOT, line); break;
+        case TOKEN_LESS:            emit_number_op(OP_LESS, OP_LESS_NN, &type, line); break;
+        case TOKEN_LESS_EQUAL:      emit_number_op(OP_GREATER, OP_GREATER_NN, &type, line); emit_byte(OP_NOT, line); break;
+        case TOKEN_GREATER:         emit_number_op(OP_GREATER, OP_GREATER_NN, &type, line); break;
+        case TOKEN_GREATER_EQUAL:   emit_number_op(OP_LESS, OP_LESS_NN, &type, line); emit_byte(OP_NOT, line); break;
 
         default: return parser.error("unreachable binary operator");
     }
+
+    // '+' may also concatenate strings, other arithmetic either produces a number or fails
+    switch (op_type) {
+        case TOKEN_PLUS:    last_type = type; break;
+        case TOKEN_MINUS:
+        case TOKEN_STAR:
+        case TOKEN_SLASH:   last_type = number_type(); break;
+        default:            last_type = unknown_type(); break;
+    }
 }
 
 static void variable(bool lvalue) {
@@ -682,6 +1165,7 @@ static void variable(bool lvalue) {
 
 static void function(bool _lvalue) {
     function_helper(TYPE_ANONYMOUS);
+    last_type = unknown_type();
 }
 
 static void and_(bool _lvalue) {
@@ -692,6 +1176,7 @@ static void and_(bool _lvalue) {
     expr_precedence(PREC_AND);
 
     patch_jump(jump, here());
+    last_type = unknown_type();
 }
 
 static void or_(bool _lvalue) {
@@ -702,6 +1187,7 @@ static void or_(bool _lvalue) {
     expr_precedence(PREC_OR);
 
     patch_jump(jump, here());
+    last_type = unknown_type();
 }
 
 static int arguments() {
@@ -720,10 +1206,32 @@ static int arguments() {
     return count;
 }
 
+// intrinsic of the native held by a global just read by the callee, or INTRINSIC_NONE
+static Intrinsic callee_intrinsic(ExprType* callee) {
+    if (callee->global < 0 || callee->end != here()) return INTRINSIC_NONE;
+
+    ObjString* name = AS_STRING(current_chunk()->constants.values[callee->global]);
+    Value value;
+    if (!compiling_vm->get_global_once(name, &value) || !IS_NATIVE(value)) return INTRINSIC_NONE;
+    return AS_NATIVE(value)->intrinsic;
+}
+
 static void call(bool _lvalue) {
     int line = parser.line();
+    ExprType callee = last_type;
+
+    // the callee is still read before the arguments, which may reassign it, and then only
+    // checked to hold the native of the intrinsic
+    Intrinsic intrinsic = callee_intrinsic(&callee);
+
     int argc = arguments();
-    emit_bytes(OP_CALL, argc, line);
+    if (intrinsic != INTRINSIC_NONE) {
+        emit_bytes(OP_INTRINSIC, intrinsic, line);
+        emit_byte(argc, line);
+    } else {
+        emit_bytes(OP_CALL, argc, line);
+    }
+    last_type = unknown_type();
 }
 
 static void dot(bool lvalue) {
@@ -740,6 +1248,39 @@ static void dot(bool lvalue) {
     } else {
         emit_get_property(name_constant, line);
     }
+    last_type = unknown_type();
+}
+
+static void list(bool _lvalue) {
+    int line = parser.line();
+    int count = 0;
+    if (!parser.check(TOKEN_RIGHT_BRACKET)) {
+        do {
+            if (count >= 255) {
+                parser.error_at_current("Can't have more than 255 elements in a list literal.");
+                break;
+            }
+            expression();
+            count++;
+        } while (parser.match(TOKEN_COMMA));
+    }
+    parser.consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    emit_bytes(OP_LIST, count, line);
+    last_type = unknown_type();
+}
+
+static void subscript(bool lvalue) {
+    int line = parser.line();
+    expression();
+    parser.consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (lvalue && parser.match(TOKEN_EQUAL)) {
+        expression();
+        emit_byte(OP_INDEX_SET, line);
+    } else {
+        emit_byte(OP_INDEX_GET, line);
+    }
+    last_type = unknown_type();
 }
 
 static void this_(bool lvalue) {
@@ -770,6 +1311,7 @@ static void super_(bool lvalue) {
         variable_helper(&super_token, false);
         emit_get_super(method_constant, line);
     }
+    last_type = unknown_type();
 }
 
 //
@@ -1107,9 +1649,11 @@ static void var_decl() {
 
     int line = parser.line();
 
+    ExprType type = unknown_type();
     if (parser.match(TOKEN_EQUAL)) {
         // parse initial value, leaving it on stack
         expression();
+        type = last_type;
     } else {
         // use nil as initial value
         emit_byte(OP_NIL, line);
@@ -1119,7 +1663,54 @@ static void var_decl() {
 
     if (current->scope_depth > 0) {
         define_local(index);
+        type_local(&current->locals[index], &type);
+    } else {
+        emit_define_global(index, line);
+    }
+}
+
+// true when name is a global defined by earlier compiles, or declared earlier in this one
+// natives may be shadowed by constants, as they only define common names for convenience
+static bool is_declared_global(Token* name) {
+    Value name_string = string_value(compiling_vm, name->start, name->length);
+    if (IS_NIL(name_string)) return false;
+    if (declared_globals.get(AS_STRING(name_string), NULL)) return true;
+    Value value;
+    return compiling_vm->get_globals()->get(AS_STRING(name_string), &value) && !IS_NATIVE(value);
+}
+
+static void const_decl() {
+    // code assigning to an existing global would fail once it became a constant
+    if (current->scope_depth <= 0 && parser.check(TOKEN_IDENTIFIER) && is_declared_global(&parser.current)) {
+        return parser.error_at_current("Already a variable with this name.");
+    }
+
+    int index = parse_variable("Expect constant name.", false);
+    if (index < 0) return;
+
+    int line = parser.line();
+
+    // parse value, leaving it on stack
+    parser.consume(TOKEN_EQUAL, "Expect '=' after constant name.");
+    int value_start = here();
+    expression();
+    ExprType type = last_type;
+    // only when the whole initializer was folded to a single push
+    bool has_value = is_constant_at(&type, here()) && type.start == value_start;
+
+    parser.consume(TOKEN_SEMICOLON, "Expect ';' after constant declaration.");
+
+    if (current->scope_depth > 0) {
+        Local* local = &current->locals[index];
+        define_local(index);
+        type_local(local, &type);
+        local->is_const = true;
+        local->has_value = has_value;
+        if (has_value) local->value = type.constant;
     } else {
+        ObjString* name = AS_STRING(current_chunk()->constants.values[index]);
+        pending_constant_names.insert(name, NIL_VAL);
+        if (has_value) pending_constant_values.insert(name, type.constant);
         emit_define_global(index, line);
     }
 }
@@ -1127,6 +1718,8 @@ static void var_decl() {
 static void declaration(LoopContext* loop_ctx) {
     if (parser.match(TOKEN_CLASS)) {
         class_decl();
+    } else if (parser.match(TOKEN_CONST)) {
+        const_decl();
     } else if (parser.match(TOKEN_FUN)) {
         fun_decl();
     } else if (parser.match(TOKEN_VAR)) {
@@ -1144,35 +1737,80 @@ static void variable_helper(Token* name, bool lvalue) {
     // local
     int local = resolve_local(current, name);
     if (local >= 0) {
+        Local* var = &current->locals[local];
+        int type_id = var->type_id;
+        int start = here();
         if (lvalue && parser.match(TOKEN_EQUAL)) {
+            if (var->is_const) parser.error("Can't assign to constant variable.");
             expression();
+            assign_type(current, type_id, &last_type);
             emit_set_local(local, line);
+            var->is_reassigned = true;
+        } else if (var->has_value && emit_constant_value(var->value, line)) {
+            last_type = constant_type(var->value, start);
         } else {
             emit_get_local(local, line);
+            last_type = unknown_type();
+            if (type_id >= 0 && !current->typed_locals[type_id].polluted) {
+                last_type = number_type();
+                last_type.dep_count = 1;
+                last_type.deps[0] = type_id;
+            }
         }
         return;
     }
 
+    // constants of enclosing functions are inlined, rather than captured
+    Local* outer = resolve_outer_local(current, name);
+    if (outer != NULL && outer->has_value && !(lvalue && parser.check(TOKEN_EQUAL))) {
+        int start = here();
+        if (emit_constant_value(outer->value, line)) {
+            last_type = constant_type(outer->value, start);
+            return;
+        }
+    }
+
     // upvalue
     int upvalue = resolve_upvalue(current, name);
     if (upvalue >= 0) {
         if (lvalue && parser.match(TOKEN_EQUAL)) {
+            if (outer != NULL && outer->is_const) parser.error("Can't assign to constant variable.");
             expression();
             emit_set_upvalue(upvalue, line);
+            reassign_upvalue(current, upvalue);
         } else {
             emit_get_upvalue(upvalue, line);
         }
+        last_type = unknown_type();
         return;
     }
 
     // global
     int constant = make_identifier_constant(name);
+    if (constant < 0) return;
+    ObjString* name_string = AS_STRING(current_chunk()->constants.values[constant]);
+    Value value;
     if (lvalue && parser.match(TOKEN_EQUAL)) {
+        if (is_constant_global(name_string)) parser.error("Can't assign to constant variable.");
         expression();
         emit_set_global(constant, line);
+    } else if (get_constant_global(name_string, &value)) {
+        int start = here();
+        if (emit_constant_value(value, line)) {
+            last_type = constant_type(value, start);
+            return;
+        }
+        emit_get_global(constant, line);
     } else {
+        int start = here();
         emit_get_global(constant, line);
+        last_type = unknown_type();
+        last_type.global = constant;
+        last_type.start = start;
+        last_type.end = here();
+        return;
     }
+    last_type = unknown_type();
 }
 
 static void function_helper(FunctionType type) {
@@ -1231,6 +1869,7 @@ static void function_helper(FunctionType type) {
         emit_closure(OBJ_VAL(fn));
         int line = parser.line();
         for (int i=0; i < fn->upvalue_count; i++) {
+            if (compiler.upvalues[i].is_local) record_capture(compiler.upvalues[i].index, here());
             emit_upvalue_ref(compiler.upvalues[i].index, compiler.upvalues[i].is_local, line);
         }
     } else {
@@ -1261,7 +1900,20 @@ ObjFunction* compile(const char* src, VM* vm) {
     ObjFunction* result = end_compiler();
     bool ok = !parser.had_error();
 
+    if (ok) {
+        for (int i = 0; i < pending_constant_names.get_slot_count(); i++) {
+            ObjString* name = pending_constant_names.get_key(i);
+            if (name == NULL) continue;
+            Value value = NIL_VAL;
+            bool has_value = pending_constant_values.get(name, &value);
+            vm->define_constant_global(name, has_value, value);
+        }
+    }
+
     // clear the static globals
+    declared_globals.clear();
+    pending_constant_names.clear();
+    pending_constant_values.clear();
     current_class = NULL;
     current = NULL;
     compiling_vm = NULL;
@@ -1271,6 +1923,9 @@ ObjFunction* compile(const char* src, VM* vm) {
 }
 
 void mark_compiler_roots() {
+    declared_globals.mark_objects();
+    pending_constant_names.mark_objects();
+    pending_constant_values.mark_objects();
     Compiler* compiler = current;
     while (compiler) {
         mark_object((Obj*) compiler->fn);
@@ -1,5 +1,6 @@
 #include "debug.h"
 #include "object.h"
+#include "memory.h"
 
 #include <stdio.h>
 
@@ -79,8 +80,9 @@ static int print_upvalue_refs(Chunk* chunk, int constant, int offset) {
         int index = chunk->code[offset++];
         index |= chunk->code[offset++] << 8;
         bool is_local = (index & 0x8000) != 0;
-        index &= 0x7FFF;
-        printf("%04d      |                     %s %d\n", offset - 2, is_local ? "local" : "upval", index);
+        bool is_copy = (index & 0x4000) != 0;
+        index &= 0x3FFF;
+        printf("%04d      |                     %s %d\n", offset - 2, is_copy ? "copy " : is_local ? "local" : "upval", index);
     }
     return offset;
 }
@@ -185,6 +187,16 @@ int print_instruction(Chunk* chunk, int offset) {
     case OP_INVOKE_24:
         return print_invoke_24_inst("OP_INVOKE_24", chunk, offset);
 
+    case OP_INVOKE_CACHED: {
+        InlineCache* cache = &chunk->caches[chunk->code[offset + 1]];
+        print_invoke("OP_INVOKE_CACHED", chunk, cache->constant, chunk->code[offset + 2]);
+        return offset + 3;
+    }
+
+    case OP_INTRINSIC:
+        printf("%-16s (%d args) %4d\n", "OP_INTRINSIC", chunk->code[offset + 2], chunk->code[offset + 1]);
+        return offset + 3;
+
     case OP_INVOKE_SUPER:
         return print_invoke_inst("OP_INVOKE_SUPER", chunk, offset);
     case OP_INVOKE_SUPER_16:
@@ -284,6 +296,19 @@ int print_instruction(Chunk* chunk, int offset) {
     case OP_GREATER:
         return print_simple_inst("OP_GREATER", offset);
 
+    case OP_ADD_NN:
+        return print_simple_inst("OP_ADD_NN", offset);
+    case OP_SUBTRACT_NN:
+        return print_simple_inst("OP_SUBTRACT_NN", offset);
+    case OP_MULTIPLY_NN:
+        return print_simple_inst("OP_MULTIPLY_NN", offset);
+    case OP_DIVIDE_NN:
+        return print_simple_inst("OP_DIVIDE_NN", offset);
+    case OP_LESS_NN:
+        return print_simple_inst("OP_LESS_NN", offset);
+    case OP_GREATER_NN:
+        return print_simple_inst("OP_GREATER_NN", offset);
+
     case OP_NEGATE:
         return print_simple_inst("OP_NEGATE", offset);
     case OP_NOT:
@@ -309,6 +334,18 @@ int print_instruction(Chunk* chunk, int offset) {
         return print_simple_inst("OP_CLOSE_UPVALUE", offset);
     case OP_INHERIT:
         return print_simple_inst("OP_INHERIT", offset);
+    case OP_LIST:
+        return print_index_inst("OP_LIST", chunk, offset);
+    case OP_BUILD_STRING:
+        return print_index_inst("OP_BUILD_STRING", chunk, offset);
+    case OP_INDEX_GET:
+        return print_simple_inst("OP_INDEX_GET", offset);
+    case OP_INDEX_SET:
+        return print_simple_inst("OP_INDEX_SET", offset);
+    case OP_NOP:
+        return print_simple_inst("OP_NOP", offset);
+    case OP_DUP:
+        return print_simple_inst("OP_DUP", offset);
 
     default:
         printf("Unknown opcode %d\n", inst);
@@ -324,11 +361,18 @@ void print_value(Value value) {
         printf(AS_BOOL(value) ? "true" : "false");
         return;
     } else if (IS_NUMBER(value)) {
-        printf("%.10g", AS_NUMBER(value));
+        char buffer[NUMBER_BUFFER];
+        int length = format_number(AS_NUMBER(value), buffer);
+        printf("%.*s", length, buffer);
         return;
     } else if (IS_OBJ(value)) {
         print_object(AS_OBJ(value));
         return;
+    } else if (IS_SHORT_STRING(value)) {
+        char chars[SHORT_STRING_BUFFER];
+        int length = short_string_chars(value, chars);
+        printf("%.*s", length, chars);
+        return;
     }
 
     printf("Unrecognized value type\n");
@@ -349,6 +393,19 @@ void print_object(Obj* object) {
             printf("%s", ((ObjString*) object)->chars);
             return;
         }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*) object;
+            char* chars = ALLOC_ARRAY(char, rope->length);
+            rope_chars(rope, chars);
+            printf("%.*s", (int) rope->length, chars);
+            FREE_ARRAY(char, chars, rope->length);
+            return;
+        }
+        case OBJ_SLICE: {
+            ObjSlice* slice = (ObjSlice*) object;
+            printf("%.*s", (int) slice->length, slice_chars(slice));
+            return;
+        }
         case OBJ_FUNCTION: {
             ObjString* name = ((ObjFunction*) object)->name;
             if (name) {
@@ -389,26 +446,100 @@ void print_object(Obj* object) {
             print_value(method);
             return;
         }
+        case OBJ_LIST: {
+            // lists may contain themselves
+            static int depth = 0;
+            if (depth > 8) {
+                printf("[...]");
+                return;
+            }
+            depth++;
+            ValueArray* items = &((ObjList*) object)->items;
+            printf("[");
+            for (int i = 0; i < items->length; i++) {
+                if (i > 0) printf(", ");
+                print_value(items->values[i]);
+            }
+            printf("]");
+            depth--;
+            return;
+        }
+        case OBJ_FLOAT_ARRAY: {
+            ObjFloatArray* array = (ObjFloatArray*) object;
+            printf("Float64Array(");
+            for (uint32_t i = 0; i < array->length; i++) {
+                if (i > 0) printf(", ");
+                print_value(NUMBER_VAL(array->values[i]));
+            }
+            printf(")");
+            return;
+        }
+        case OBJ_MAP: {
+            static int depth = 0;
+            if (depth > 8) {
+                printf("{...}");
+                return;
+            }
+            depth++;
+            ValueTable* table = &((ObjMap*) object)->table;
+            printf("{");
+            bool first = true;
+            for (int i = 0; i < table->get_capacity(); i++) {
+                ValueEntry* entry = table->entry(i);
+                if (entry == NULL) continue;
+                if (!first) printf(", ");
+                print_value(entry->key);
+                printf(": ");
+                print_value(entry->value);
+                first = false;
+            }
+            printf("}");
+            depth--;
+            return;
+        }
+        case OBJ_ORDERED_MAP: {
+            static int depth = 0;
+            if (depth > 8) {
+                printf("{...}");
+                return;
+            }
+            depth++;
+            BTree* tree = &((ObjOrderedMap*) object)->tree;
+            ValueArray keys;
+            tree->keys(&keys);
+            printf("{");
+            for (int i = 0; i < keys.length; i++) {
+                Value value;
+                tree->get(keys.values[i], &value);
+                if (i > 0) printf(", ");
+                print_value(keys.values[i]);
+                printf(": ");
+                print_value(value);
+            }
+            printf("}");
+            depth--;
+            return;
+        }
     }
 }
 
 void print_table(Table* table) {
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;  // also skip tombstones
+    for (int i = 0; i < table->get_slot_count(); i++) {
+        ObjString* key = table->get_key(i);
+        if (key == NULL) continue;  // also skip tombstones
 
-        printf("    %10s = ", entry->key->chars);
-        print_value(entry->value);
+        printf("    %10s = ", key->chars);
+        print_value(table->get_value(i));
         printf("\n");
     }
 }
 
 void print_strings(Table* table) {
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;  // also skip tombstones
+    for (int i = 0; i < table->get_slot_count(); i++) {
+        ObjString* key = table->get_key(i);
+        if (key == NULL) continue;  // also skip tombstones
 
-        printf("  %s", entry->key->chars);
+        printf("  %s", key->chars);
         if (i % 32 == 31) {
             printf("\n");
         }
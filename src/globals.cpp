@@ -1,11 +1,648 @@
 #include "globals.h"
 #include "object.h"
-#include <time.h>
+#include "kernels.h"
+#include <math.h>
+#include <string.h>
 
-static Value clock_native(int argc, Value* args) {
-    return NUMBER_VAL((double) clock() / CLOCKS_PER_SEC);
+static Value clock_native(VM* vm, int argc, Value* args) {
+    return NUMBER_VAL(clock_seconds());
+}
+
+static double sqrt_native(double a) {
+    return sqrt(a);
+}
+
+static double floor_native(double a) {
+    return floor(a);
+}
+
+static double abs_native(double a) {
+    return fabs(a);
+}
+
+static double min_native(double a, double b) {
+    return a < b ? a : b;
+}
+
+static double max_native(double a, double b) {
+    return a > b ? a : b;
+}
+
+#define BISECT_MAX_BOUND 9007199254740992.0     // 2^53
+
+// smallest integer in [lo, hi) for which predicate returns true, or hi when there is none
+// predicate must be false up to some integer, and true from then on
+static Value bisect_native(VM* vm, int argc, Value* args) {
+    if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) {
+        return vm->native_error("Bounds must be numbers.");
+    }
+
+    double lo = ceil(AS_NUMBER(args[0]));
+    double hi = ceil(AS_NUMBER(args[1]));
+    // beyond 2^53 mid + 1 may round back to mid, and infinite bounds never meet
+    if (!(fabs(lo) <= BISECT_MAX_BOUND && fabs(hi) <= BISECT_MAX_BOUND)) {
+        return vm->native_error("Bounds must be finite and at most 2^53.");
+    }
+    Value predicate = args[2];
+
+    while (lo < hi) {
+        Value mid = NUMBER_VAL(floor(lo + (hi - lo) / 2));
+        Value result;
+        if (!vm->call(predicate, 1, &mid, &result)) return NIL_VAL;
+
+        if (is_truthy(result)) {
+            hi = AS_NUMBER(mid);
+        } else {
+            lo = AS_NUMBER(mid) + 1;
+        }
+    }
+    return NUMBER_VAL(lo);
+}
+
+// adds value to the end of list, growing its storage geometrically
+static Value append_native(VM* vm, int argc, Value* args) {
+    if (!IS_LIST(args[0])) {
+        return vm->native_error("Can only append to a list.");
+    }
+    AS_LIST(args[0])->items.write(args[1]);
+    return args[1];
+}
+
+// removes and returns the last element of list
+static Value pop_native(VM* vm, int argc, Value* args) {
+    if (!IS_LIST(args[0])) {
+        return vm->native_error("Can only pop from a list.");
+    }
+    ValueArray* items = &AS_LIST(args[0])->items;
+    if (items->length == 0) {
+        return vm->native_error("Can't pop from an empty list.");
+    }
+    return items->values[--items->length];
+}
+
+// sort(list, before) in place, where before(a, b) is true when a must come before b
+// a stable merge sort, which makes few calls back into Lox: at most n log2 n
+static Value sort_native(VM* vm, int argc, Value* args) {
+    if (!IS_LIST(args[0])) {
+        return vm->native_error("Can only sort a list.");
+    }
+    ObjList* list = AS_LIST(args[0]);
+    Value before = args[1];
+    int length = list->items.length;
+
+    // merge between two copies, which the stack keeps alive, and which the callback can't change
+    ObjList* copy = new_list(vm);
+    vm->push(OBJ_VAL(copy));
+    ObjList* scratch = new_list(vm);
+    vm->push(OBJ_VAL(scratch));
+    for (int i = 0; i < length; i++) {
+        copy->items.write(list->items.values[i]);
+        scratch->items.write(NIL_VAL);
+    }
+
+    Value* from = copy->items.values;
+    Value* to = scratch->items.values;
+    for (int width = 1; width < length; width *= 2) {
+        for (int lo = 0; lo < length; lo += 2 * width) {
+            int mid = lo + width < length ? lo + width : length;
+            int hi = lo + 2 * width < length ? lo + 2 * width : length;
+            int i = lo, j = mid, k = lo;
+            while (i < mid && j < hi) {
+                // take from the right run only when strictly before, so equal elements keep their order
+                Value pair[2] = { from[j], from[i] };
+                Value result;
+                if (!vm->call(before, 2, pair, &result)) return NIL_VAL;
+                to[k++] = is_truthy(result) ? from[j++] : from[i++];
+            }
+            while (i < mid) to[k++] = from[i++];
+            while (j < hi) to[k++] = from[j++];
+        }
+        Value* swap = from;
+        from = to;
+        to = swap;
+    }
+
+    list->items.length = 0;
+    for (int i = 0; i < length; i++) {
+        list->items.write(from[i]);
+    }
+    vm->pop();
+    vm->pop();
+    return args[0];
+}
+
+static Value len_native(VM* vm, int argc, Value* args) {
+    if (IS_LIST(args[0])) {
+        return NUMBER_VAL(AS_LIST(args[0])->items.length);
+    } else if (IS_FLOAT_ARRAY(args[0])) {
+        return NUMBER_VAL(AS_FLOAT_ARRAY(args[0])->length);
+    } else if (IS_MAP(args[0])) {
+        return NUMBER_VAL(AS_MAP(args[0])->table.get_count());
+    } else if (IS_ORDERED_MAP(args[0])) {
+        return NUMBER_VAL(AS_ORDERED_MAP(args[0])->tree.get_count());
+    } else if (is_string_like(args[0])) {
+        return NUMBER_VAL(string_length(args[0]));
+    }
+    return vm->native_error("Can only take the length of a list, array, map or string.");
+}
+
+// string natives are passed slices as they are, and return slices sharing their characters
+
+// check index is an integer in [0, limit], and return it, or -1 after raising an error
+static int string_position(VM* vm, Value index, uint32_t limit) {
+    if (!IS_NUMBER(index)) {
+        vm->native_error("String index must be a number.");
+        return -1;
+    }
+    double number = AS_NUMBER(index);
+    // only cast once in range, as casting NaN, infinities and huge numbers is undefined
+    if (number != trunc(number)) {
+        vm->native_error("String index must be an integer.");
+        return -1;
+    }
+    if (number < 0 || number > limit) {
+        vm->native_error("String index out of range.");
+        return -1;
+    }
+    return (int) number;
+}
+
+// substring(string, start, end) of the characters from start up to but not including end
+static Value substring_native(VM* vm, int argc, Value* args) {
+    if (!is_string_like(args[0])) return vm->native_error("Argument must be a string.");
+    uint32_t length = string_length(args[0]);
+    int start = string_position(vm, args[1], length);
+    if (start < 0) return NIL_VAL;
+    int end = string_position(vm, args[2], length);
+    if (end < 0) return NIL_VAL;
+    if (end < start) return vm->native_error("String index out of range.");
+    return substring(vm, args[0], start, end - start);
+}
+
+static Value char_at_native(VM* vm, int argc, Value* args) {
+    if (!is_string_like(args[0])) return vm->native_error("Argument must be a string.");
+    uint32_t length = string_length(args[0]);
+    int index = string_position(vm, args[1], length);
+    if (index < 0) return NIL_VAL;
+    if (index == (int) length) return vm->native_error("String index out of range.");
+    return substring(vm, args[0], index, 1);
+}
+
+// index_of(string, part) of the first occurrence of part, or -1 when there is none
+static Value index_of_native(VM* vm, int argc, Value* args) {
+    if (!is_string_like(args[0]) || !is_string_like(args[1])) {
+        return vm->native_error("Arguments must be strings.");
+    }
+    char buffer[SHORT_STRING_BUFFER];
+    char part_buffer[SHORT_STRING_BUFFER];
+    const char* chars = string_chars(args[0], buffer);
+    const char* part = string_chars(args[1], part_buffer);
+    return NUMBER_VAL(string_kernels()->find(chars, string_length(args[0]), part, string_length(args[1])));
+}
+
+static Value starts_with_native(VM* vm, int argc, Value* args) {
+    if (!is_string_like(args[0]) || !is_string_like(args[1])) {
+        return vm->native_error("Arguments must be strings.");
+    }
+    uint32_t length = string_length(args[1]);
+    if (length > string_length(args[0])) return BOOL_VAL(false);
+    char buffer[SHORT_STRING_BUFFER];
+    char prefix_buffer[SHORT_STRING_BUFFER];
+    return BOOL_VAL(memcmp(string_chars(args[0], buffer), string_chars(args[1], prefix_buffer), length) == 0);
+}
+
+// split(string, separator) into a list of the parts between each separator
+static Value split_native(VM* vm, int argc, Value* args) {
+    if (!is_string_like(args[0]) || !is_string_like(args[1])) {
+        return vm->native_error("Arguments must be strings.");
+    }
+    int length = string_length(args[0]);
+    int separator_length = string_length(args[1]);
+    if (separator_length == 0) return vm->native_error("Separator must not be empty.");
+    char buffer[SHORT_STRING_BUFFER];
+    char separator_buffer[SHORT_STRING_BUFFER];
+    const char* chars = string_chars(args[0], buffer);
+    const char* separator = string_chars(args[1], separator_buffer);
+
+    ObjList* parts = new_list(vm);
+    vm->push(OBJ_VAL(parts));
+    int start = 0;
+    while (true) {
+        int found = string_kernels()->find(chars + start, length - start, separator, separator_length);
+        int end = found < 0 ? length : start + found;
+        parts->items.write(substring(vm, args[0], start, end - start));
+        if (found < 0) break;
+        start = end + separator_length;
+    }
+    vm->pop();
+    return OBJ_VAL(parts);
+}
+
+// join(list, separator) of strings into a single string, allocated once
+static Value join_native(VM* vm, int argc, Value* args) {
+    if (!IS_LIST(args[0]) || !is_string_like(args[1])) {
+        return vm->native_error("Expected a list and a string.");
+    }
+    ValueArray* items = &AS_LIST(args[0])->items;
+    uint64_t length = 0;
+    for (int i = 0; i < items->length; i++) {
+        if (!is_string_like(items->values[i])) return vm->native_error("List elements must be strings.");
+        length += string_length(items->values[i]);
+    }
+    if (items->length == 1) return items->values[0];
+    uint32_t separator_length = string_length(args[1]);
+    if (items->length > 1) length += (uint64_t) separator_length * (items->length - 1);
+    if (length >= STRING_MAX_LEN) return vm->native_error("String too long.");
+
+    ObjString* result = start_string(length);
+    char* dest = result->chars;
+    for (int i = 0; i < items->length; i++) {
+        if (i > 0) {
+            copy_chars(args[1], dest);
+            dest += separator_length;
+        }
+        copy_chars(items->values[i], dest);
+        dest += string_length(items->values[i]);
+    }
+    return finish_string(vm, result);
+}
+
+// replace(string, pattern, replacement) of every occurrence of pattern, from left to right
+static Value replace_native(VM* vm, int argc, Value* args) {
+    if (!is_string_like(args[0]) || !is_string_like(args[1]) || !is_string_like(args[2])) {
+        return vm->native_error("Arguments must be strings.");
+    }
+    int length = string_length(args[0]);
+    int pattern_length = string_length(args[1]);
+    int replacement_length = string_length(args[2]);
+    if (pattern_length == 0) return vm->native_error("Pattern must not be empty.");
+    char buffer[SHORT_STRING_BUFFER];
+    char pattern_buffer[SHORT_STRING_BUFFER];
+    char replacement_buffer[SHORT_STRING_BUFFER];
+    const char* chars = string_chars(args[0], buffer);
+    const char* pattern = string_chars(args[1], pattern_buffer);
+    const char* replacement = string_chars(args[2], replacement_buffer);
+    const StringKernels* kernels = string_kernels();
+
+    // count first, so the result is allocated once
+    int count = 0;
+    for (int start = 0, found; (found = kernels->find(chars + start, length - start, pattern, pattern_length)) >= 0; ) {
+        count++;
+        start += found + pattern_length;
+    }
+    if (count == 0) return args[0];
+    int64_t result_length = length + (int64_t) count * (replacement_length - pattern_length);
+    if (result_length >= STRING_MAX_LEN) return vm->native_error("String too long.");
+
+    ObjString* result = start_string(result_length);
+    char* dest = result->chars;
+    int start = 0;
+    for (int i = 0; i < count; i++) {
+        int found = kernels->find(chars + start, length - start, pattern, pattern_length);
+        memcpy(dest, chars + start, found);
+        memcpy(dest + found, replacement, replacement_length);
+        dest += found + replacement_length;
+        start += found + pattern_length;
+    }
+    memcpy(dest, chars + start, length - start);
+    return finish_string(vm, result);
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// trim(string) of spaces, tabs and newlines at either end
+static Value trim_native(VM* vm, int argc, Value* args) {
+    if (!is_string_like(args[0])) return vm->native_error("Argument must be a string.");
+    int end = string_length(args[0]);
+    char buffer[SHORT_STRING_BUFFER];
+    const char* chars = string_chars(args[0], buffer);
+    int start = 0;
+    while (start < end && is_space(chars[start])) start++;
+    while (end > start && is_space(chars[end - 1])) end--;
+    return substring(vm, args[0], start, end - start);
+}
+
+static Value map_case(VM* vm, Value string, void (*kernel)(char* dest, const char* s, int n)) {
+    if (!is_string_like(string)) return vm->native_error("Argument must be a string.");
+    int length = string_length(string);
+    char buffer[SHORT_STRING_BUFFER];
+    ObjString* result = start_string(length);
+    kernel(result->chars, string_chars(string, buffer), length);
+    return finish_string(vm, result);
+}
+
+static Value upper_native(VM* vm, int argc, Value* args) {
+    return map_case(vm, args[0], string_kernels()->upper);
+}
+
+static Value lower_native(VM* vm, int argc, Value* args) {
+    return map_case(vm, args[0], string_kernels()->lower);
+}
+
+// compiled pattern, from the cache of the VM, or NULL after raising an error
+static Regex* regex_args(VM* vm, Value* args) {
+    if (!is_string_like(args[0]) || !is_string_like(args[1])) {
+        vm->native_error("Arguments must be strings.");
+        return NULL;
+    }
+    char buffer[SHORT_STRING_BUFFER];
+    const char* error;
+    Regex* regex = vm->get_regexes()->get(string_chars(args[1], buffer), string_length(args[1]), &error);
+    if (!regex) vm->native_error("Invalid pattern: %s.", error);
+    return regex;
+}
+
+// match(string, pattern) is true if the whole string matches
+static Value match_native(VM* vm, int argc, Value* args) {
+    Regex* regex = regex_args(vm, args);
+    if (!regex) return NIL_VAL;
+    char buffer[SHORT_STRING_BUFFER];
+    return BOOL_VAL(regex->match(string_chars(args[0], buffer), string_length(args[0])));
+}
+
+// search(string, pattern) for the leftmost match, or nil when there is none
+static Value search_native(VM* vm, int argc, Value* args) {
+    Regex* regex = regex_args(vm, args);
+    if (!regex) return NIL_VAL;
+    char buffer[SHORT_STRING_BUFFER];
+    int start, end;
+    if (!regex->search(string_chars(args[0], buffer), string_length(args[0]), 0, &start, &end)) return NIL_VAL;
+    return substring(vm, args[0], start, end - start);
+}
+
+// find_all(string, pattern) into a list of the matches which don't overlap, from left to right
+static Value find_all_native(VM* vm, int argc, Value* args) {
+    Regex* regex = regex_args(vm, args);
+    if (!regex) return NIL_VAL;
+    int length = string_length(args[0]);
+    char buffer[SHORT_STRING_BUFFER];
+    const char* chars = string_chars(args[0], buffer);
+
+    ObjList* matches = new_list(vm);
+    vm->push(OBJ_VAL(matches));
+    int start, end;
+    for (int from = 0; from <= length && regex->search(chars, length, from, &start, &end); ) {
+        matches->items.write(substring(vm, args[0], start, end - start));
+        // an empty match is taken once, then skipped
+        from = end > start ? end : end + 1;
+    }
+    vm->pop();
+    return OBJ_VAL(matches);
+}
+
+// Float64Array(length) of zeros, or Float64Array(list) copying a list of numbers
+static Value float_array_native(VM* vm, int argc, Value* args) {
+    if (IS_NUMBER(args[0])) {
+        double length = AS_NUMBER(args[0]);
+        if (length < 0 || length > FLOAT_ARRAY_MAX_LEN || length != trunc(length)) {
+            return vm->native_error("Array length must be a non-negative integer.");
+        }
+        return OBJ_VAL(new_float_array(vm, (int) length));
+    }
+
+    if (!IS_LIST(args[0])) {
+        return vm->native_error("Expected a length or a list.");
+    }
+    ValueArray* items = &AS_LIST(args[0])->items;
+    for (int i = 0; i < items->length; i++) {
+        if (!IS_NUMBER(items->values[i])) {
+            return vm->native_error("Array elements must be numbers.");
+        }
+    }
+    if (items->length > FLOAT_ARRAY_MAX_LEN) {
+        return vm->native_error("Array length must be a non-negative integer.");
+    }
+    ObjFloatArray* array = new_float_array(vm, items->length);
+    for (int i = 0; i < items->length; i++) {
+        array->values[i] = AS_NUMBER(items->values[i]);
+    }
+    return OBJ_VAL(array);
+}
+
+// bulk operations of arrays, run by the kernels for this CPU
+
+static bool are_float_arrays(Value* args, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!IS_FLOAT_ARRAY(args[i])) return false;
+    }
+    return true;
+}
+
+static bool same_length(Value a, Value b) {
+    return AS_FLOAT_ARRAY(a)->length == AS_FLOAT_ARRAY(b)->length;
+}
+
+static Value sum_native(VM* vm, int argc, Value* args) {
+    if (!are_float_arrays(args, 1)) return vm->native_error("Argument must be an array.");
+    ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+    return NUMBER_VAL(float_kernels()->sum(a->values, a->length));
+}
+
+static Value dot_native(VM* vm, int argc, Value* args) {
+    if (!are_float_arrays(args, 2)) return vm->native_error("Arguments must be arrays.");
+    if (!same_length(args[0], args[1])) return vm->native_error("Arrays must have the same length.");
+    ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+    ObjFloatArray* b = AS_FLOAT_ARRAY(args[1]);
+    return NUMBER_VAL(float_kernels()->dot(a->values, b->values, a->length));
+}
+
+static Value min_of_native(VM* vm, int argc, Value* args) {
+    if (!are_float_arrays(args, 1)) return vm->native_error("Argument must be an array.");
+    ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+    if (a->length == 0) return vm->native_error("Array must not be empty.");
+    return NUMBER_VAL(float_kernels()->min(a->values, a->length));
+}
+
+static Value max_of_native(VM* vm, int argc, Value* args) {
+    if (!are_float_arrays(args, 1)) return vm->native_error("Argument must be an array.");
+    ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+    if (a->length == 0) return vm->native_error("Array must not be empty.");
+    return NUMBER_VAL(float_kernels()->max(a->values, a->length));
+}
+
+// the natives below update their first array in place, and return it
+
+static Value scale_native(VM* vm, int argc, Value* args) {
+    if (!are_float_arrays(args, 1) || !IS_NUMBER(args[1])) {
+        return vm->native_error("Expected an array and a number.");
+    }
+    ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+    float_kernels()->scale(a->values, AS_NUMBER(args[1]), a->length);
+    return args[0];
+}
+
+// axpy(y, alpha, x) computes y = y + alpha * x
+static Value axpy_native(VM* vm, int argc, Value* args) {
+    if (!IS_FLOAT_ARRAY(args[0]) || !IS_NUMBER(args[1]) || !IS_FLOAT_ARRAY(args[2])) {
+        return vm->native_error("Expected an array, a number and an array.");
+    }
+    if (!same_length(args[0], args[2])) return vm->native_error("Arrays must have the same length.");
+    ObjFloatArray* y = AS_FLOAT_ARRAY(args[0]);
+    ObjFloatArray* x = AS_FLOAT_ARRAY(args[2]);
+    float_kernels()->axpy(AS_NUMBER(args[1]), x->values, y->values, y->length);
+    return args[0];
+}
+
+static Value add_native(VM* vm, int argc, Value* args) {
+    if (!are_float_arrays(args, 2)) return vm->native_error("Arguments must be arrays.");
+    if (!same_length(args[0], args[1])) return vm->native_error("Arrays must have the same length.");
+    ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+    float_kernels()->add(a->values, AS_FLOAT_ARRAY(args[1])->values, a->length);
+    return args[0];
+}
+
+static Value mul_native(VM* vm, int argc, Value* args) {
+    if (!are_float_arrays(args, 2)) return vm->native_error("Arguments must be arrays.");
+    if (!same_length(args[0], args[1])) return vm->native_error("Arrays must have the same length.");
+    ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+    float_kernels()->mul(a->values, AS_FLOAT_ARRAY(args[1])->values, a->length);
+    return args[0];
+}
+
+static Value prefix_sum_native(VM* vm, int argc, Value* args) {
+    if (!are_float_arrays(args, 1)) return vm->native_error("Argument must be an array.");
+    ObjFloatArray* a = AS_FLOAT_ARRAY(args[0]);
+    float_kernels()->prefix_sum(a->values, a->length);
+    return args[0];
+}
+
+// collect() garbage now, returning [objects, interned strings, slots of the string table]
+static Value collect_native(VM* vm, int argc, Value* args) {
+    vm->gc();
+    ObjList* stats = new_list(vm);
+    stats->items.write(NUMBER_VAL(vm->get_object_count()));
+    stats->items.write(NUMBER_VAL(vm->get_string_count()));
+    stats->items.write(NUMBER_VAL(vm->get_string_capacity()));
+    return OBJ_VAL(stats);
+}
+
+static Value map_native(VM* vm, int argc, Value* args) {
+    return OBJ_VAL(new_map(vm));
+}
+
+static Value ordered_map_native(VM* vm, int argc, Value* args) {
+    return OBJ_VAL(new_ordered_map(vm));
+}
+
+static bool is_any_map(Value value) {
+    return IS_MAP(value) || IS_ORDERED_MAP(value);
+}
+
+static Value size_native(VM* vm, int argc, Value* args) {
+    if (IS_MAP(args[0])) return NUMBER_VAL(AS_MAP(args[0])->table.get_count());
+    if (IS_ORDERED_MAP(args[0])) return NUMBER_VAL(AS_ORDERED_MAP(args[0])->tree.get_count());
+    return vm->native_error("Argument must be a map.");
+}
+
+static Value has_native(VM* vm, int argc, Value* args) {
+    if (!is_any_map(args[0])) return vm->native_error("Argument must be a map.");
+    if (IS_ORDERED_MAP(args[0])) {
+        return BOOL_VAL(is_ordered_key(args[1]) && AS_ORDERED_MAP(args[0])->tree.get(args[1], NULL));
+    }
+    return BOOL_VAL(is_valid_key(args[1]) && AS_MAP(args[0])->table.get(args[1], NULL));
+}
+
+// returns whether the key was present
+static Value delete_native(VM* vm, int argc, Value* args) {
+    if (!is_any_map(args[0])) return vm->native_error("Argument must be a map.");
+    if (IS_ORDERED_MAP(args[0])) {
+        return BOOL_VAL(is_ordered_key(args[1]) && AS_ORDERED_MAP(args[0])->tree.remove(args[1]));
+    }
+    return BOOL_VAL(is_valid_key(args[1]) && AS_MAP(args[0])->table.remove(args[1]));
+}
+
+// list of the keys of a map for iterating over it, sorted for ordered maps
+static Value keys_native(VM* vm, int argc, Value* args) {
+    if (!is_any_map(args[0])) return vm->native_error("Argument must be a map.");
+    ObjList* keys = new_list(vm);
+    if (IS_ORDERED_MAP(args[0])) {
+        AS_ORDERED_MAP(args[0])->tree.keys(&keys->items);
+        return OBJ_VAL(keys);
+    }
+    ValueTable* table = &AS_MAP(args[0])->table;
+    for (int i = 0; i < table->get_capacity(); i++) {
+        ValueEntry* entry = table->entry(i);
+        if (entry) keys->items.write(entry->key);
+    }
+    return OBJ_VAL(keys);
+}
+
+// greatest key <= key, or nil
+static Value floor_key_native(VM* vm, int argc, Value* args) {
+    if (!IS_ORDERED_MAP(args[0])) return vm->native_error("Argument must be an ordered map.");
+    if (!is_ordered_key(args[1])) return vm->native_error("Ordered map keys must be numbers or strings.");
+    Value key;
+    return AS_ORDERED_MAP(args[0])->tree.floor(args[1], &key) ? key : NIL_VAL;
+}
+
+// least key >= key, or nil
+static Value ceiling_key_native(VM* vm, int argc, Value* args) {
+    if (!IS_ORDERED_MAP(args[0])) return vm->native_error("Argument must be an ordered map.");
+    if (!is_ordered_key(args[1])) return vm->native_error("Ordered map keys must be numbers or strings.");
+    Value key;
+    return AS_ORDERED_MAP(args[0])->tree.ceiling(args[1], &key) ? key : NIL_VAL;
+}
+
+// sorted list of the keys from low to high inclusive
+static Value range_native(VM* vm, int argc, Value* args) {
+    if (!IS_ORDERED_MAP(args[0])) return vm->native_error("Argument must be an ordered map.");
+    if (!is_ordered_key(args[1]) || !is_ordered_key(args[2])) {
+        return vm->native_error("Ordered map keys must be numbers or strings.");
+    }
+    ObjList* keys = new_list(vm);
+    AS_ORDERED_MAP(args[0])->tree.range(args[1], args[2], &keys->items);
+    return OBJ_VAL(keys);
+}
+
+static void intrinsic(Value native, Intrinsic intrinsic) {
+    AS_NATIVE(native)->intrinsic = intrinsic;
 }
 
 void define_globals(VM* vm) {
-    define_native(vm, "clock", clock_native);
+    intrinsic(define_native(vm, "clock", clock_native, 0), INTRINSIC_CLOCK);
+    intrinsic(define_native(vm, "sqrt", sqrt_native), INTRINSIC_SQRT);
+    intrinsic(define_native(vm, "floor", floor_native), INTRINSIC_FLOOR);
+    intrinsic(define_native(vm, "abs", abs_native), INTRINSIC_ABS);
+    define_native(vm, "min", min_native);
+    define_native(vm, "max", max_native);
+    define_native(vm, "bisect", bisect_native, 3);
+    define_native(vm, "append", append_native, 2);
+    define_native(vm, "pop", pop_native, 1);
+    define_native(vm, "sort", sort_native, 2);
+    define_view_native(vm, "len", len_native, 1);
+    define_view_native(vm, "substring", substring_native, 3);
+    define_view_native(vm, "char_at", char_at_native, 2);
+    define_view_native(vm, "index_of", index_of_native, 2);
+    define_view_native(vm, "starts_with", starts_with_native, 2);
+    define_view_native(vm, "split", split_native, 2);
+    define_view_native(vm, "join", join_native, 2);
+    define_view_native(vm, "replace", replace_native, 3);
+    define_view_native(vm, "trim", trim_native, 1);
+    define_view_native(vm, "upper", upper_native, 1);
+    define_view_native(vm, "lower", lower_native, 1);
+    define_view_native(vm, "match", match_native, 2);
+    define_view_native(vm, "search", search_native, 2);
+    define_view_native(vm, "find_all", find_all_native, 2);
+    define_native(vm, "Float64Array", float_array_native, 1);
+    define_native(vm, "sum", sum_native, 1);
+    define_native(vm, "dot", dot_native, 2);
+    define_native(vm, "min_of", min_of_native, 1);
+    define_native(vm, "max_of", max_of_native, 1);
+    define_native(vm, "scale", scale_native, 2);
+    define_native(vm, "axpy", axpy_native, 3);
+    define_native(vm, "add", add_native, 2);
+    define_native(vm, "mul", mul_native, 2);
+    define_native(vm, "prefix_sum", prefix_sum_native, 1);
+    define_native(vm, "collect", collect_native, 0);
+    define_native(vm, "Map", map_native, 0);
+    define_native(vm, "size", size_native, 1);
+    define_native(vm, "has", has_native, 2);
+    define_native(vm, "delete", delete_native, 2);
+    define_native(vm, "keys", keys_native, 1);
+    define_native(vm, "OrderedMap", ordered_map_native, 0);
+    define_native(vm, "floor_key", floor_key_native, 2);
+    define_native(vm, "ceiling_key", ceiling_key_native, 2);
+    define_native(vm, "range", range_native, 3);
 }
@@ -3,4 +3,11 @@
 #include "common.h"
 #include "vm.h"
 
+#include <time.h>
+
 void define_globals(VM* vm);
+
+// shared by natives, and their intrinsics in the VM
+inline double clock_seconds() {
+    return (double) clock() / CLOCKS_PER_SEC;
+}
@@ -0,0 +1,452 @@
+#include "kernels.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+// The scalar kernels define the results; the vector kernels below process 2 or 4 elements
+// at a time and finish any remainder with the same scalar loop.
+
+static double sum_scalar(const double* a, int n) {
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += a[i];
+    return sum;
+}
+
+static double dot_scalar(const double* a, const double* b, int n) {
+    double sum = 0;
+    for (int i = 0; i < n; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+static double min_scalar(const double* a, int n) {
+    double min = a[0];
+    for (int i = 0; i < n; i++) min = a[i] < min ? a[i] : min;
+    return min;
+}
+
+static double max_scalar(const double* a, int n) {
+    double max = a[0];
+    for (int i = 0; i < n; i++) max = a[i] > max ? a[i] : max;
+    return max;
+}
+
+static void scale_scalar(double* a, double k, int n) {
+    for (int i = 0; i < n; i++) a[i] *= k;
+}
+
+static void axpy_scalar(double alpha, const double* x, double* y, int n) {
+    for (int i = 0; i < n; i++) y[i] += alpha * x[i];
+}
+
+static void add_scalar(double* a, const double* b, int n) {
+    for (int i = 0; i < n; i++) a[i] += b[i];
+}
+
+static void mul_scalar(double* a, const double* b, int n) {
+    for (int i = 0; i < n; i++) a[i] *= b[i];
+}
+
+static void prefix_sum_scalar(double* a, int n) {
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += a[i];
+        a[i] = sum;
+    }
+}
+
+static const FloatKernels scalar_kernels = {
+    "scalar",
+    sum_scalar, dot_scalar, min_scalar, max_scalar,
+    scale_scalar, axpy_scalar, add_scalar, mul_scalar, prefix_sum_scalar,
+};
+
+#ifdef KERNELS_X86
+
+// SSE2 is part of x86-64, so needs no detection
+
+static double horizontal_sum(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+static double sum_sse2(const double* a, int n) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(a + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(a + i + 2));
+    }
+    return horizontal_sum(_mm_add_pd(acc0, acc1)) + sum_scalar(a + i, n - i);
+}
+
+static double dot_sse2(const double* a, const double* b, int n) {
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    return horizontal_sum(_mm_add_pd(acc0, acc1)) + dot_scalar(a + i, b + i, n - i);
+}
+
+// lanes start from a[0], so that like the scalar loop they only hold a NaN if a[0] is one
+static double min_sse2(const double* a, int n) {
+    __m128d min = _mm_set1_pd(a[0]);
+    int i = 0;
+    for (; i + 2 <= n; i += 2) min = _mm_min_pd(_mm_loadu_pd(a + i), min);
+    double lanes[2];
+    _mm_storeu_pd(lanes, min);
+    double result = lanes[1] < lanes[0] ? lanes[1] : lanes[0];
+    for (; i < n; i++) result = a[i] < result ? a[i] : result;
+    return result;
+}
+
+static double max_sse2(const double* a, int n) {
+    __m128d max = _mm_set1_pd(a[0]);
+    int i = 0;
+    for (; i + 2 <= n; i += 2) max = _mm_max_pd(_mm_loadu_pd(a + i), max);
+    double lanes[2];
+    _mm_storeu_pd(lanes, max);
+    double result = lanes[1] > lanes[0] ? lanes[1] : lanes[0];
+    for (; i < n; i++) result = a[i] > result ? a[i] : result;
+    return result;
+}
+
+static void scale_sse2(double* a, double k, int n) {
+    __m128d factor = _mm_set1_pd(k);
+    int i = 0;
+    for (; i + 2 <= n; i += 2) _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), factor));
+    scale_scalar(a + i, k, n - i);
+}
+
+static void axpy_sse2(double alpha, const double* x, double* y, int n) {
+    __m128d factor = _mm_set1_pd(alpha);
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d product = _mm_mul_pd(factor, _mm_loadu_pd(x + i));
+        _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), product));
+    }
+    axpy_scalar(alpha, x + i, y + i, n - i);
+}
+
+static void add_sse2(double* a, const double* b, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) _mm_storeu_pd(a + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    add_scalar(a + i, b + i, n - i);
+}
+
+static void mul_sse2(double* a, const double* b, int n) {
+    int i = 0;
+    for (; i + 2 <= n; i += 2) _mm_storeu_pd(a + i, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+    mul_scalar(a + i, b + i, n - i);
+}
+
+// [x0, x1] becomes [x0, x0 + x1], then the running total is added to both lanes
+static void prefix_sum_sse2(double* a, int n) {
+    __m128d total = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128d x = _mm_loadu_pd(a + i);
+        x = _mm_add_pd(x, _mm_unpacklo_pd(_mm_setzero_pd(), x));
+        x = _mm_add_pd(x, total);
+        _mm_storeu_pd(a + i, x);
+        total = _mm_unpackhi_pd(x, x);
+    }
+    double sum = _mm_cvtsd_f64(total);
+    for (; i < n; i++) {
+        sum += a[i];
+        a[i] = sum;
+    }
+}
+
+static const FloatKernels sse2_kernels = {
+    "sse2",
+    sum_sse2, dot_sse2, min_sse2, max_sse2,
+    scale_sse2, axpy_sse2, add_sse2, mul_sse2, prefix_sum_sse2,
+};
+
+// AVX2 kernels are compiled for that target only, and called only once the CPU reports it.
+// Multiplies and adds are kept separate rather than fused, to round as the scalar loop does.
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static double horizontal_sum_avx2(__m256d v) {
+    __m128d pair = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(pair, _mm_unpackhi_pd(pair, pair)));
+}
+
+AVX2 static double sum_avx2(const double* a, int n) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(a + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(a + i + 4));
+    }
+    return horizontal_sum_avx2(_mm256_add_pd(acc0, acc1)) + sum_scalar(a + i, n - i);
+}
+
+AVX2 static double dot_avx2(const double* a, const double* b, int n) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+    }
+    return horizontal_sum_avx2(_mm256_add_pd(acc0, acc1)) + dot_scalar(a + i, b + i, n - i);
+}
+
+AVX2 static double min_avx2(const double* a, int n) {
+    __m256d min = _mm256_set1_pd(a[0]);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) min = _mm256_min_pd(_mm256_loadu_pd(a + i), min);
+    double lanes[4];
+    _mm256_storeu_pd(lanes, min);
+    double result = min_scalar(lanes, 4);
+    for (; i < n; i++) result = a[i] < result ? a[i] : result;
+    return result;
+}
+
+AVX2 static double max_avx2(const double* a, int n) {
+    __m256d max = _mm256_set1_pd(a[0]);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) max = _mm256_max_pd(_mm256_loadu_pd(a + i), max);
+    double lanes[4];
+    _mm256_storeu_pd(lanes, max);
+    double result = max_scalar(lanes, 4);
+    for (; i < n; i++) result = a[i] > result ? a[i] : result;
+    return result;
+}
+
+AVX2 static void scale_avx2(double* a, double k, int n) {
+    __m256d factor = _mm256_set1_pd(k);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), factor));
+    scale_scalar(a + i, k, n - i);
+}
+
+AVX2 static void axpy_avx2(double alpha, const double* x, double* y, int n) {
+    __m256d factor = _mm256_set1_pd(alpha);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d product = _mm256_mul_pd(factor, _mm256_loadu_pd(x + i));
+        _mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i), product));
+    }
+    axpy_scalar(alpha, x + i, y + i, n - i);
+}
+
+AVX2 static void add_avx2(double* a, const double* b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) _mm256_storeu_pd(a + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    add_scalar(a + i, b + i, n - i);
+}
+
+AVX2 static void mul_avx2(double* a, const double* b, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) _mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+    mul_scalar(a + i, b + i, n - i);
+}
+
+// the scan is bound by its dependency on the running total, so wider lanes gain little
+static const FloatKernels avx2_kernels = {
+    "avx2",
+    sum_avx2, dot_avx2, min_avx2, max_avx2,
+    scale_avx2, axpy_avx2, add_avx2, mul_avx2, prefix_sum_sse2,
+};
+
+#endif
+
+static const FloatKernels* select_kernels() {
+    #ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return &avx2_kernels;
+    return &sse2_kernels;
+    #else
+    return &scalar_kernels;
+    #endif
+}
+
+const FloatKernels* float_kernels() {
+    static const FloatKernels* kernels = NULL;
+    if (kernels == NULL) kernels = select_kernels();
+    return kernels;
+}
+
+// Scanning kernels for the string natives.  find() tests the first and last byte of part at
+// 16 or 32 positions at once, and only compares the whole of part where both match.
+
+static int find_byte_scalar(const char* s, int n, char c) {
+    for (int i = 0; i < n; i++) {
+        if (s[i] == c) return i;
+    }
+    return -1;
+}
+
+static int find_scalar(const char* s, int n, const char* part, int m) {
+    if (m <= 1) return m == 0 ? 0 : find_byte_scalar(s, n, part[0]);
+    for (int i = 0; i + m <= n; i++) {
+        if (s[i] == part[0] && memcmp(s + i, part, m) == 0) return i;
+    }
+    return -1;
+}
+
+static void upper_scalar(char* dest, const char* s, int n) {
+    for (int i = 0; i < n; i++) {
+        char c = s[i];
+        dest[i] = c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
+    }
+}
+
+static void lower_scalar(char* dest, const char* s, int n) {
+    for (int i = 0; i < n; i++) {
+        char c = s[i];
+        dest[i] = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    }
+}
+
+static const StringKernels scalar_string_kernels = {
+    "scalar",
+    find_scalar, upper_scalar, lower_scalar,
+};
+
+#ifdef KERNELS_X86
+
+static int find_byte_sse2(const char* s, int n, char c) {
+    __m128i needle = _mm_set1_epi8(c);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (s + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    int found = find_byte_scalar(s + i, n - i, c);
+    return found < 0 ? -1 : i + found;
+}
+
+static int find_sse2(const char* s, int n, const char* part, int m) {
+    if (m <= 1) return m == 0 ? 0 : find_byte_sse2(s, n, part[0]);
+
+    __m128i first = _mm_set1_epi8(part[0]);
+    __m128i last = _mm_set1_epi8(part[m - 1]);
+    int i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i starts = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i ends = _mm_loadu_si128((const __m128i*) (s + i + m - 1));
+        __m128i both = _mm_and_si128(_mm_cmpeq_epi8(starts, first), _mm_cmpeq_epi8(ends, last));
+        unsigned mask = _mm_movemask_epi8(both);
+        while (mask) {
+            int at = i + __builtin_ctz(mask);
+            if (memcmp(s + at + 1, part + 1, m - 2) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+    int found = find_scalar(s + i, n - i, part, m);
+    return found < 0 ? -1 : i + found;
+}
+
+// chars from lo to hi as a mask, compared as signed bytes, so no byte above 0x7f is in range
+static __m128i in_range_sse2(__m128i chunk, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8(lo - 1)), _mm_cmpgt_epi8(_mm_set1_epi8(hi + 1), chunk));
+}
+
+static void upper_sse2(char* dest, const char* s, int n) {
+    __m128i flip = _mm_set1_epi8('a' - 'A');
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i change = _mm_and_si128(in_range_sse2(chunk, 'a', 'z'), flip);
+        _mm_storeu_si128((__m128i*) (dest + i), _mm_sub_epi8(chunk, change));
+    }
+    upper_scalar(dest + i, s + i, n - i);
+}
+
+static void lower_sse2(char* dest, const char* s, int n) {
+    __m128i flip = _mm_set1_epi8('a' - 'A');
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i change = _mm_and_si128(in_range_sse2(chunk, 'A', 'Z'), flip);
+        _mm_storeu_si128((__m128i*) (dest + i), _mm_add_epi8(chunk, change));
+    }
+    lower_scalar(dest + i, s + i, n - i);
+}
+
+static const StringKernels sse2_string_kernels = {
+    "sse2",
+    find_sse2, upper_sse2, lower_sse2,
+};
+
+AVX2 static int find_avx2(const char* s, int n, const char* part, int m) {
+    if (m == 0) return 0;
+
+    __m256i first = _mm256_set1_epi8(part[0]);
+    __m256i last = _mm256_set1_epi8(part[m - 1]);
+    int i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i starts = _mm256_loadu_si256((const __m256i*) (s + i));
+        __m256i ends = _mm256_loadu_si256((const __m256i*) (s + i + m - 1));
+        __m256i both = _mm256_and_si256(_mm256_cmpeq_epi8(starts, first), _mm256_cmpeq_epi8(ends, last));
+        unsigned mask = _mm256_movemask_epi8(both);
+        while (mask) {
+            int at = i + __builtin_ctz(mask);
+            if (m <= 2 || memcmp(s + at + 1, part + 1, m - 2) == 0) return at;
+            mask &= mask - 1;
+        }
+    }
+    int found = find_sse2(s + i, n - i, part, m);
+    return found < 0 ? -1 : i + found;
+}
+
+AVX2 static __m256i in_range_avx2(__m256i chunk, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(chunk, _mm256_set1_epi8(lo - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(hi + 1), chunk));
+}
+
+AVX2 static void upper_avx2(char* dest, const char* s, int n) {
+    __m256i flip = _mm256_set1_epi8('a' - 'A');
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*) (s + i));
+        __m256i change = _mm256_and_si256(in_range_avx2(chunk, 'a', 'z'), flip);
+        _mm256_storeu_si256((__m256i*) (dest + i), _mm256_sub_epi8(chunk, change));
+    }
+    upper_sse2(dest + i, s + i, n - i);
+}
+
+AVX2 static void lower_avx2(char* dest, const char* s, int n) {
+    __m256i flip = _mm256_set1_epi8('a' - 'A');
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*) (s + i));
+        __m256i change = _mm256_and_si256(in_range_avx2(chunk, 'A', 'Z'), flip);
+        _mm256_storeu_si256((__m256i*) (dest + i), _mm256_add_epi8(chunk, change));
+    }
+    lower_sse2(dest + i, s + i, n - i);
+}
+
+static const StringKernels avx2_string_kernels = {
+    "avx2",
+    find_avx2, upper_avx2, lower_avx2,
+};
+
+#endif
+
+static const StringKernels* select_string_kernels() {
+    #ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return &avx2_string_kernels;
+    return &sse2_string_kernels;
+    #else
+    return &scalar_string_kernels;
+    #endif
+}
+
+const StringKernels* string_kernels() {
+    static const StringKernels* kernels = NULL;
+    if (kernels == NULL) kernels = select_string_kernels();
+    return kernels;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "common.h"
+
+// Bulk operations on arrays of raw doubles, used by the natives of Float64Array.
+// Element-wise kernels round exactly as the scalar loop would, whichever instruction set is
+// used.  Reductions (sum, dot) add in a different order when vectorized.
+struct FloatKernels {
+    const char* name;
+    double (*sum)(const double* a, int n);
+    double (*dot)(const double* a, const double* b, int n);
+    double (*min)(const double* a, int n);      // n must be positive
+    double (*max)(const double* a, int n);
+    void (*scale)(double* a, double k, int n);
+    void (*axpy)(double alpha, const double* x, double* y, int n);
+    void (*add)(double* a, const double* b, int n);
+    void (*mul)(double* a, const double* b, int n);
+    void (*prefix_sum)(double* a, int n);
+};
+
+// the fastest kernels supported by this CPU, detected on first use
+const FloatKernels* float_kernels();
+
+// Scanning operations on chars, used by the string natives.  All give the same results as the
+// scalar loops.  Case mapping covers ASCII letters only.
+struct StringKernels {
+    const char* name;
+    int (*find)(const char* s, int n, const char* part, int m);    // index of part in s, or -1
+    void (*upper)(char* dest, const char* s, int n);
+    void (*lower)(char* dest, const char* s, int n);
+};
+
+const StringKernels* string_kernels();
@@ -2,7 +2,7 @@
 #include <string.h>
 
 Lexer::Lexer() :
-    start(NULL), current(NULL), line(0), token_line(0)
+    start(NULL), current(NULL), line(0), token_line(0), interpolation_depth(0)
 {
 }
 
@@ -14,6 +14,7 @@ void Lexer::init(const char* src) {
     this->current = src;
     this->line = 1;
     this->token_line = 1;
+    this->interpolation_depth = 0;
 }
 
 static bool is_digit(char c) {
@@ -46,8 +47,21 @@ Token Lexer::next_token() {
     switch (c) {
         case '(': return make_token(TOKEN_LEFT_PAREN);
         case ')': return make_token(TOKEN_RIGHT_PAREN);
-        case '{': return make_token(TOKEN_LEFT_BRACE);
-        case '}': return make_token(TOKEN_RIGHT_BRACE);
+        case '{':
+            if (this->interpolation_depth > 0) this->braces[this->interpolation_depth - 1]++;
+            return make_token(TOKEN_LEFT_BRACE);
+        case '}':
+            if (this->interpolation_depth > 0) {
+                if (this->braces[this->interpolation_depth - 1] == 0) {
+                    // end of the expression, so continue the string
+                    this->interpolation_depth--;
+                    return string();
+                }
+                this->braces[this->interpolation_depth - 1]--;
+            }
+            return make_token(TOKEN_RIGHT_BRACE);
+        case '[': return make_token(TOKEN_LEFT_BRACKET);
+        case ']': return make_token(TOKEN_RIGHT_BRACKET);
         case ',': return make_token(TOKEN_COMMA);
         case '.': return make_token(TOKEN_DOT);
         case '-': return make_token(TOKEN_MINUS);
@@ -142,8 +156,18 @@ void Lexer::skip_whitespace() {
     }
 }
 
+// the lexeme includes the opening " or the } ending an interpolation, and the closing " or ${
 Token Lexer::string() {
     while (!at_eof() && peek() != '"') {
+        if (peek() == '$' && peek_next() == '{') {
+            if (this->interpolation_depth == INTERPOLATION_MAX) {
+                return error_token("Interpolation nested too deeply.");
+            }
+            advance();
+            advance();
+            this->braces[this->interpolation_depth++] = 0;
+            return make_token(TOKEN_INTERPOLATION);
+        }
         if (peek() == '\n')
             this->line++;
         advance();
@@ -185,7 +209,10 @@ Token Lexer::identifier() {
             if (this->current - this->start > 1) {
                 switch (this->start[1]) {
                     case 'l': return check_keyword(2, 3, "ass", TOKEN_CLASS);
-                    case 'o': return check_keyword(2, 6, "ntinue", TOKEN_CONTINUE);
+                    case 'o': {
+                        if (this->current - this->start == 5) return check_keyword(2, 3, "nst", TOKEN_CONST);
+                        return check_keyword(2, 6, "ntinue", TOKEN_CONTINUE);
+                    }
                 }
             }
             break;
@@ -2,6 +2,8 @@
 
 #include "common.h"
 
+#define INTERPOLATION_MAX   8
+
 enum TokenType {
     TOKEN_EOF,
     TOKEN_ERROR,
@@ -10,6 +12,8 @@ enum TokenType {
     TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE,
     TOKEN_RIGHT_BRACE,
+    TOKEN_LEFT_BRACKET,
+    TOKEN_RIGHT_BRACKET,
     TOKEN_COMMA,
     TOKEN_DOT,
     TOKEN_MINUS,
@@ -29,11 +33,13 @@ enum TokenType {
 
     TOKEN_IDENTIFIER,
     TOKEN_STRING,
+    TOKEN_INTERPOLATION,    // part of a string before ${, which is followed by an expression
     TOKEN_NUMBER,
 
     TOKEN_AND,
     TOKEN_BREAK,
     TOKEN_CLASS,
+    TOKEN_CONST,
     TOKEN_CONTINUE,
     TOKEN_ELSE,
     TOKEN_FALSE,
@@ -84,4 +90,9 @@ private:
     const char* current;
     int line;
     int token_line;
+
+    // for each interpolation being lexed, the depth of braces within its expression, so the
+    // closing brace which continues the string can be told apart
+    int braces[INTERPOLATION_MAX];
+    int interpolation_depth;
 };
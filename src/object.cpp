@@ -40,7 +40,7 @@ void free_object(Obj* object) {
         }
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*) object;
-            size_t size = sizeof(ObjClosure) + closure->upvalue_count * sizeof(ObjUpvalue*);
+            size_t size = sizeof(ObjClosure) + closure->upvalue_count * sizeof(Value);
             reallocate(closure, size, 0);
             break;
         }
@@ -61,6 +61,40 @@ void free_object(Obj* object) {
             FREE(ObjBoundMethod, bound);
             break;
         }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*) object;
+            list->items.~ValueArray();
+            FREE(ObjList, list);
+            break;
+        }
+        case OBJ_FLOAT_ARRAY: {
+            ObjFloatArray* array = (ObjFloatArray*) object;
+            size_t size = sizeof(ObjFloatArray) + array->length * sizeof(double);
+            reallocate(array, size, 0);
+            break;
+        }
+        case OBJ_MAP: {
+            ObjMap* map = (ObjMap*) object;
+            map->table.~ValueTable();
+            FREE(ObjMap, map);
+            break;
+        }
+        case OBJ_ORDERED_MAP: {
+            ObjOrderedMap* map = (ObjOrderedMap*) object;
+            map->tree.~BTree();
+            FREE(ObjOrderedMap, map);
+            break;
+        }
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*) object;
+            FREE(ObjRope, rope);
+            break;
+        }
+        case OBJ_SLICE: {
+            ObjSlice* slice = (ObjSlice*) object;
+            FREE(ObjSlice, slice);
+            break;
+        }
     }
 }
 
@@ -80,12 +114,14 @@ void mark_object(Obj* object) {
     switch (object->type) {
         case OBJ_STRING:
         case OBJ_NATIVE:
+        case OBJ_FLOAT_ARRAY:
             break;
 
         case OBJ_FUNCTION: {
             ObjFunction* fn = (ObjFunction*) object;
             mark_object((Obj*) fn->name);
-            fn->chunk.constants.mark_objects();
+            mark_value(fn->inline_value);
+            fn->chunk.mark_objects();
             break;
         }
         case OBJ_UPVALUE: {
@@ -98,7 +134,7 @@ void mark_object(Obj* object) {
             ObjClosure* closure = (ObjClosure*) object;
             mark_object((Obj*) closure->fn);
             for (int i=0; i < closure->upvalue_count; i++) {
-                mark_object((Obj*) closure->upvalues[i]);
+                mark_value(closure->upvalues[i]);
             }
             break;
         }
@@ -120,16 +156,102 @@ void mark_object(Obj* object) {
             mark_value(bound->method);
             break;
         }
+        case OBJ_LIST: {
+            ObjList* list = (ObjList*) object;
+            list->items.mark_objects();
+            break;
+        }
+        case OBJ_MAP: {
+            ObjMap* map = (ObjMap*) object;
+            map->table.mark_objects();
+            break;
+        }
+        case OBJ_ORDERED_MAP: {
+            ObjOrderedMap* map = (ObjOrderedMap*) object;
+            map->tree.mark_objects();
+            break;
+        }
+        case OBJ_ROPE: {
+            // ropes built a piece at a time nest as deep as they are long, so loop down the longer
+            // side and only recurse into the shorter, which holds at most half of the chars
+            ObjRope* rope = (ObjRope*) object;
+            for (;;) {
+                if (rope->flat) {
+                    mark_object((Obj*) rope->flat);
+                    break;
+                }
+                Value longer = rope->left;
+                Value shorter = rope->right;
+                if (string_length(shorter) > string_length(longer)) {
+                    longer = rope->right;
+                    shorter = rope->left;
+                }
+                mark_value(shorter);
+                if (!IS_ROPE(longer) || AS_OBJ(longer)->marked) {
+                    mark_value(longer);
+                    break;
+                }
+                rope = AS_ROPE(longer);
+                rope->obj.marked = true;
+            }
+            break;
+        }
+        case OBJ_SLICE: {
+            ObjSlice* slice = (ObjSlice*) object;
+            mark_object((Obj*) slice->parent);
+            mark_object((Obj*) slice->flat);
+            break;
+        }
+    }
+}
+
+// multiply to 128 bits and fold the halves together, so every input bit affects every output bit
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+// Hashes 8 bytes per step rather than one, which matters for the long strings that ropes
+// flatten.  On identifier-like keys it spreads across table slots as well as the FNV-1a hash
+// it replaced: test_hash_quality() in test/test.cpp measures collisions and probe lengths.
+uint32_t hash_string(const char* key, int length) {
+    uint64_t hash = 0x9e3779b97f4a7c15ull ^ (uint64_t) length;
+
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, key + i, sizeof(word));
+        hash = mix(hash ^ word, 0xa0761d6478bd642full);
     }
+
+    uint64_t tail = 0;
+    memcpy(&tail, key + i, length - i);
+    hash = mix(hash ^ tail, 0xe7037ed1a0b428dbull);
+
+    return (uint32_t) (hash ^ (hash >> 32));
 }
 
-static uint32_t hash_string(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t) key[i];
-        hash *= 16777619;
+// a string of length, neither interned nor registered, whose chars are left for the caller to
+// fill in before passing it to finish_string()
+ObjString* start_string(int length) {
+    ObjString* result = (ObjString*) alloc_object(sizeof(ObjString) + length + 1, OBJ_STRING);
+    result->global_state = GLOBAL_UNDEFINED;
+    result->interned = false;
+    result->hash = 0;
+    result->length = length;
+    result->chars[length] = '\0';
+    return result;
+}
+
+// the value of a string from start_string(), held in the value itself instead if short enough
+Value finish_string(VM* vm, ObjString* string) {
+    if ((int) string->length <= SHORT_STRING_MAX) {
+        Value result = short_string_value(string->chars, string->length);
+        free_object((Obj*) string);
+        return result;
     }
-    return hash;
+    vm->register_object((Obj*) string);
+    return OBJ_VAL(string);
 }
 
 Value string_value(VM* vm, const char* str, int length) {
@@ -142,12 +264,10 @@ Value string_value(VM* vm, const char* str, int length) {
 
     // <-- ObjString -->
     // [ type | length | chars ... ]
-    size_t size = sizeof(ObjString) + (length + 1) * sizeof(char);
-    ObjString* result = (ObjString*) alloc_object(size, OBJ_STRING);
+    ObjString* result = start_string(length);
     memcpy(result->chars, str, length);
-    result->chars[length] = '\0';
-    result->length = length;
     result->hash = hash;
+    result->interned = true;
 
     // keep track of string for interning and garbage collection
     vm->register_object((Obj*) result);
@@ -156,42 +276,242 @@ Value string_value(VM* vm, const char* str, int length) {
     return OBJ_VAL(result);
 }
 
+// a string value, held in the value itself when short enough
+// names of variables and properties must always be ObjStrings, from string_value()
+Value make_string(VM* vm, const char* str, int length) {
+    if (length <= SHORT_STRING_MAX) return short_string_value(str, length);
+    return string_value(vm, str, length);
+}
+
+// as make_string, but for strings made while running, which are only hashed and interned once
+// they are used as keys or compared with a rope, as most are just printed or dropped
+Value runtime_string(VM* vm, const char* str, int length) {
+    if (length <= SHORT_STRING_MAX) return short_string_value(str, length);
+    if (length >= STRING_MAX_LEN) return NIL_VAL;
+
+    ObjString* result = start_string(length);
+    memcpy(result->chars, str, length);
+    vm->register_object((Obj*) result);
+    return OBJ_VAL(result);
+}
+
+// chars of a part of an interpolated string, formatting numbers into buffer[NUMBER_BUFFER],
+// or NULL for a rope, whose chars must be copied with rope_chars()
+static const char* part_chars(Value part, char* buffer, uint32_t* length) {
+    if (IS_NUMBER(part)) {
+        *length = format_number(AS_NUMBER(part), buffer);
+        return buffer;
+    }
+    if (IS_BOOL(part)) {
+        *length = AS_BOOL(part) ? 4 : 5;
+        return AS_BOOL(part) ? "true" : "false";
+    }
+    if (IS_NIL(part)) {
+        *length = 3;
+        return "nil";
+    }
+    *length = string_length(part);
+    return IS_ROPE(part) ? NULL : string_chars(part, buffer);
+}
+
+void copy_chars(Value string, char* dest) {
+    if (IS_ROPE(string)) {
+        rope_chars(AS_ROPE(string), dest);
+    } else {
+        char buffer[SHORT_STRING_BUFFER];
+        memcpy(dest, string_chars(string, buffer), string_length(string));
+    }
+}
+
+// parts, each a string, number, boolean or nil, joined into a string which is allocated once,
+// or nil when too long
+Value build_string(VM* vm, Value* parts, int count) {
+    char buffer[NUMBER_BUFFER];
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++) {
+        uint32_t length;
+        part_chars(parts[i], buffer, &length);
+        total += length;
+    }
+    if (total >= STRING_MAX_LEN) return NIL_VAL;
+
+    ObjString* result = start_string(total);
+    char* dest = result->chars;
+    for (int i = 0; i < count; i++) {
+        uint32_t length;
+        const char* chars = part_chars(parts[i], buffer, &length);
+        if (chars) {
+            memcpy(dest, chars, length);
+        } else {
+            rope_chars(AS_ROPE(parts[i]), dest);
+        }
+        dest += length;
+    }
+
+    return finish_string(vm, result);
+}
+
+// the interned string equal to string, which is interned itself if there is none yet
+ObjString* intern_string(VM* vm, ObjString* string) {
+    if (string->interned) return string;
+
+    string->hash = hash_string(string->chars, string->length);
+    ObjString* interned = vm->strings.find_string(string->chars, string->length, string->hash);
+    if (interned) return interned;
+
+    string->interned = true;
+    vm->strings.insert(string, NIL_VAL);
+    return string;
+}
+
+// strings or short strings
 Value concatenate_strings(VM* vm, Value a, Value b) {
-    ObjString* sa = AS_STRING(a);
-    ObjString* sb = AS_STRING(b);
+    char buffer_a[SHORT_STRING_BUFFER];
+    char buffer_b[SHORT_STRING_BUFFER];
+    const char* chars_a = string_chars(a, buffer_a);
+    const char* chars_b = string_chars(b, buffer_b);
+    int length_a = string_length(a);
+    int length_b = string_length(b);
+
+    int length = length_a + length_b;
+    if (length >= STRING_MAX_LEN) return NIL_VAL;
+
+    if (length <= SHORT_STRING_MAX) {
+        char chars[SHORT_STRING_BUFFER];
+        memcpy(chars, chars_a, length_a);
+        memcpy(chars + length_a, chars_b, length_b);
+        return short_string_value(chars, length);
+    }
 
-    int length = sa->length + sb->length;
+    // create string object as concatenation, left uninterned until needed
+    ObjString* result = start_string(length);
+    memcpy(result->chars, chars_a, length_a);
+    memcpy(result->chars + length_a, chars_b, length_b);
+    vm->register_object((Obj*) result);
+
+    return OBJ_VAL(result);
+}
+
+// strings or ropes, joining long results as a rope so that building a string piece by piece
+// takes linear rather than quadratic time
+Value concatenate_lazily(VM* vm, Value a, Value b) {
+    uint64_t length = (uint64_t) string_length(a) + string_length(b);
     if (length >= STRING_MAX_LEN) return NIL_VAL;
 
-    // create string object as concatenation
-    size_t size = sizeof(ObjString) + length + 1;
-    ObjString* result = (ObjString*) alloc_object(size, OBJ_STRING);
-    memcpy(result->chars, sa->chars, sa->length);
-    memcpy(result->chars + sa->length, sb->chars, sb->length);
-    result->chars[length] = '\0';
-    result->length = length;
-    result->hash = hash_string(result->chars, length);
-
-    // now check if we have already interned the resulting string
-    ObjString* interned = vm->strings.find_string(result->chars, result->length, result->hash);
-    if (interned) {
-        // alas, we've already made this string
-        free_object((Obj*) result);
-        return OBJ_VAL(interned);
+    // ropes are never shorter than ROPE_MIN_LEN, so neither is a rope here
+    if (length < ROPE_MIN_LEN) return concatenate_strings(vm, a, b);
+
+    ObjRope* result = (ObjRope*) alloc_object(sizeof(ObjRope), OBJ_ROPE);
+    result->length = (uint32_t) length;
+    result->left = a;
+    result->right = b;
+    result->flat = NULL;
+
+    vm->register_object((Obj*) result);
+
+    return OBJ_VAL(result);
+}
+
+// copy the characters of a rope into dest, which must hold rope->length chars
+// ropes built in a loop are deeply nested, so walk them with a stack on the heap, from the end
+void rope_chars(ObjRope* rope, char* dest) {
+    ValueArray pending;
+    pending.write(OBJ_VAL(rope));
+    uint32_t end = rope->length;
+
+    while (pending.length > 0) {
+        Value piece = pending.values[--pending.length];
+        ObjString* string = NULL;
+        if (IS_SHORT_STRING(piece)) {
+            char chars[SHORT_STRING_BUFFER];
+            int length = short_string_chars(piece, chars);
+            end -= length;
+            memcpy(dest + end, chars, length);
+            continue;
+        } else if (IS_SLICE(piece)) {
+            ObjSlice* slice = AS_SLICE(piece);
+            end -= slice->length;
+            memcpy(dest + end, slice_chars(slice), slice->length);
+            continue;
+        } else if (IS_STRING(piece)) {
+            string = AS_STRING(piece);
+        } else if (AS_ROPE(piece)->flat) {
+            string = AS_ROPE(piece)->flat;
+        } else {
+            pending.write(AS_ROPE(piece)->left);
+            pending.write(AS_ROPE(piece)->right);
+            continue;
+        }
+        end -= string->length;
+        memcpy(dest + end, string->chars, string->length);
     }
+}
+
+// a string with the characters of the rope, which is kept, though only interned when needed
+ObjString* flatten_rope(VM* vm, ObjRope* rope) {
+    if (rope->flat) return rope->flat;
+
+    ObjString* result = start_string(rope->length);
+    rope_chars(rope, result->chars);
+    vm->register_object((Obj*) result);
+
+    rope->flat = result;
+    rope->left = NIL_VAL;
+    rope->right = NIL_VAL;
+    return result;
+}
+
+// the characters of string from start, which must be a flat string, short string or slice,
+// shared with it rather than copied, unless too short for that to be worthwhile
+Value substring(VM* vm, Value string, uint32_t start, uint32_t length) {
+    if (start == 0 && length == string_length(string)) return string;
+
+    char buffer[SHORT_STRING_BUFFER];
+    const char* chars = string_chars(string, buffer) + start;
+    if (length < SLICE_MIN_LEN) return runtime_string(vm, chars, length);
+
+    // slices of slices share the same parent
+    ObjString* parent;
+    if (IS_SLICE(string)) {
+        ObjSlice* slice = AS_SLICE(string);
+        parent = slice->flat ? slice->flat : slice->parent;
+        if (!slice->flat) start += slice->start;
+    } else {
+        parent = AS_STRING(string);
+    }
+    if (parent->length >= SLICE_LARGE_PARENT && length < parent->length / SLICE_MAX_WASTE) {
+        return runtime_string(vm, chars, length);
+    }
+
+    ObjSlice* result = (ObjSlice*) alloc_object(sizeof(ObjSlice), OBJ_SLICE);
+    result->length = length;
+    result->start = start;
+    result->parent = parent;
+    result->flat = NULL;
 
-    // keep track of string for interning and garbage collection
     vm->register_object((Obj*) result);
-    vm->strings.insert(result, NIL_VAL);
 
     return OBJ_VAL(result);
 }
 
+// the interned string with the characters of the slice
+ObjString* flatten_slice(VM* vm, ObjSlice* slice) {
+    if (slice->flat) return slice->flat;
+
+    slice->flat = AS_STRING(string_value(vm, slice_chars(slice), slice->length));
+    slice->parent = NULL;
+    return slice->flat;
+}
+
 ObjFunction* new_function(VM* vm) {
     ObjFunction* result = (ObjFunction*) alloc_object(sizeof(ObjFunction), OBJ_FUNCTION);
 
     result->name = NULL;
     result->arity = 0;
+    result->hotness = 0;
+    result->optimized = false;
+    result->inline_kind = INLINE_NONE;
+    result->inline_value = NIL_VAL;
     new (&result->chunk) Chunk();
 
     vm->register_object((Obj*) result);
@@ -199,9 +519,12 @@ ObjFunction* new_function(VM* vm) {
     return result;
 }
 
-Value define_native(VM* vm, const char* name, NativeFn fn) {
+Value new_native(VM* vm, const char* name, NativeKind kind, int arity) {
     ObjNative* fn_obj = (ObjNative*) alloc_object(sizeof(ObjNative), OBJ_NATIVE);
-    fn_obj->native_fn = fn;
+    fn_obj->kind = kind;
+    fn_obj->arity = arity;
+    fn_obj->fn.values = NULL;
+    fn_obj->intrinsic = INTRINSIC_NONE;
     vm->register_object((Obj*) fn_obj);
 
     // push/pop for GC
@@ -212,6 +535,7 @@ Value define_native(VM* vm, const char* name, NativeFn fn) {
     vm->push(name_val);
 
     vm->globals.insert(AS_STRING(name_val), fn_val);
+    AS_STRING(name_val)->global_state = GLOBAL_ONCE;
 
     vm->pop();
     vm->pop();
@@ -219,14 +543,39 @@ Value define_native(VM* vm, const char* name, NativeFn fn) {
     return fn_val;
 }
 
+// pass arity of -1 to accept any number of args
+Value define_native(VM* vm, const char* name, NativeFn fn, int arity) {
+    Value fn_val = new_native(vm, name, NATIVE_VALUES, arity);
+    AS_NATIVE(fn_val)->fn.values = fn;
+    return fn_val;
+}
+
+Value define_view_native(VM* vm, const char* name, NativeFn fn, int arity) {
+    Value fn_val = new_native(vm, name, NATIVE_VIEWS, arity);
+    AS_NATIVE(fn_val)->fn.values = fn;
+    return fn_val;
+}
+
+Value define_native(VM* vm, const char* name, NativeNumberFn1 fn) {
+    Value fn_val = new_native(vm, name, NATIVE_NUMBER_1, 1);
+    AS_NATIVE(fn_val)->fn.number_1 = fn;
+    return fn_val;
+}
+
+Value define_native(VM* vm, const char* name, NativeNumberFn2 fn) {
+    Value fn_val = new_native(vm, name, NATIVE_NUMBER_2, 2);
+    AS_NATIVE(fn_val)->fn.number_2 = fn;
+    return fn_val;
+}
+
 ObjClosure* new_closure(VM* vm, ObjFunction* fn) {
-    size_t size = sizeof(ObjClosure) + fn->upvalue_count * sizeof(ObjUpvalue*);
+    size_t size = sizeof(ObjClosure) + fn->upvalue_count * sizeof(Value);
     ObjClosure* result = (ObjClosure*) alloc_object(size, OBJ_CLOSURE);
 
     result->fn = fn;
     result->upvalue_count = fn->upvalue_count;
     for (int i=0; i < fn->upvalue_count; i++) {
-        result->upvalues[i] = NULL;
+        result->upvalues[i] = NIL_VAL;
     }
 
     vm->register_object((Obj*) result);
@@ -280,3 +629,48 @@ ObjBoundMethod* new_bound_method(VM* vm, Value receiver, Value method) {
 
     return result;
 }
+
+ObjList* new_list(VM* vm) {
+    ObjList* result = (ObjList*) alloc_object(sizeof(ObjList), OBJ_LIST);
+
+    new (&result->items) ValueArray();
+
+    vm->register_object((Obj*) result);
+
+    return result;
+}
+
+// elements start as zero
+ObjFloatArray* new_float_array(VM* vm, int length) {
+    assert(length >= 0 && length <= FLOAT_ARRAY_MAX_LEN);
+
+    size_t size = sizeof(ObjFloatArray) + length * sizeof(double);
+    ObjFloatArray* result = (ObjFloatArray*) alloc_object(size, OBJ_FLOAT_ARRAY);
+
+    result->length = length;
+    memset(result->values, 0, length * sizeof(double));
+
+    vm->register_object((Obj*) result);
+
+    return result;
+}
+
+ObjMap* new_map(VM* vm) {
+    ObjMap* result = (ObjMap*) alloc_object(sizeof(ObjMap), OBJ_MAP);
+
+    new (&result->table) ValueTable();
+
+    vm->register_object((Obj*) result);
+
+    return result;
+}
+
+ObjOrderedMap* new_ordered_map(VM* vm) {
+    ObjOrderedMap* result = (ObjOrderedMap*) alloc_object(sizeof(ObjOrderedMap), OBJ_ORDERED_MAP);
+
+    new (&result->tree) BTree();
+
+    vm->register_object((Obj*) result);
+
+    return result;
+}
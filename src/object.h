@@ -4,10 +4,16 @@
 #include "value.h"
 #include "chunk.h"
 #include "table.h"
+#include "btree.h"
 
 struct VM;
 
-typedef Value (*NativeFn) (int argc, Value* args);
+// natives taking any values, which may allocate using vm, and report errors with vm->native_error()
+typedef Value (*NativeFn) (VM* vm, int argc, Value* args);
+
+// natives of numbers, called by the VM without boxing
+typedef double (*NativeNumberFn1) (double a);
+typedef double (*NativeNumberFn2) (double a, double b);
 
 enum ObjType {
     OBJ_STRING,
@@ -18,6 +24,12 @@ enum ObjType {
     OBJ_CLASS,
     OBJ_INSTANCE,
     OBJ_BOUND_METHOD,
+    OBJ_LIST,
+    OBJ_FLOAT_ARRAY,
+    OBJ_MAP,
+    OBJ_ORDERED_MAP,
+    OBJ_ROPE,
+    OBJ_SLICE,
 };
 
 struct Obj {
@@ -26,24 +38,88 @@ struct Obj {
     Obj* next;
 };
 
+// how often a global with a given name has been assigned, so its value may be embedded in code
+enum GlobalState {
+    GLOBAL_UNDEFINED,
+    GLOBAL_ONCE,
+    GLOBAL_REASSIGNED,
+};
+
 struct ObjString {
     Obj obj;
     uint32_t length;
-    uint32_t hash;
+    uint32_t hash;          // only set once interned
+    uint8_t global_state;
+    bool interned;
     char chars[];
 };
 
+// concatenation of two strings or ropes, whose characters are only copied into a string,
+// which is then interned, when flattened for equality, printing or use by natives and maps
+struct ObjRope {
+    Obj obj;
+    uint32_t length;
+    Value left;
+    Value right;
+    ObjString* flat;        // once flattened, left and right are released
+};
+
+// substring sharing the characters of its parent, which it keeps alive, until it is interned
+// for equality of identity, or for use by maps and natives other than the string natives
+struct ObjSlice {
+    Obj obj;
+    uint32_t length;
+    uint32_t start;
+    ObjString* parent;
+    ObjString* flat;        // once flattened, parent is released
+};
+
+// functions simple enough for the VM to perform a call without pushing a frame
+enum InlineKind {
+    INLINE_NONE,
+    INLINE_CONSTANT,    // return <constant>;
+    INLINE_RECEIVER,    // initializer with an empty body
+    INLINE_GETTER,      // return this.<field>;
+};
+
 struct ObjFunction {
     Obj obj;
     ObjString* name;
     uint32_t arity;
     uint32_t upvalue_count;
+    uint32_t hotness;       // calls and loop iterations, drives tier-up to the optimizer
+    bool optimized;
+    InlineKind inline_kind;
+    Value inline_value;     // constant returned, or field name for getters
     Chunk chunk;
 };
 
+// natives which the compiler may replace with OP_INTRINSIC, implemented directly by the VM
+enum Intrinsic {
+    INTRINSIC_NONE,
+    INTRINSIC_CLOCK,
+    INTRINSIC_SQRT,
+    INTRINSIC_FLOOR,
+    INTRINSIC_ABS,
+};
+
+enum NativeKind {
+    NATIVE_VALUES,
+    NATIVE_VIEWS,           // as NATIVE_VALUES, but passed slices without interning them
+    NATIVE_NUMBER_1,
+    NATIVE_NUMBER_2,
+};
+
 struct ObjNative {
     Obj obj;
-    NativeFn native_fn;
+    NativeKind kind;
+    int arity;              // checked before calling, unless -1
+    union {
+        NativeFn values;
+        NativeNumberFn1 number_1;
+        NativeNumberFn2 number_2;
+    } fn;
+    Intrinsic intrinsic;
 };
 
 struct ObjUpvalue {
@@ -57,7 +133,7 @@ struct ObjClosure {
     Obj obj;
     ObjFunction* fn;
     uint32_t upvalue_count;
-    ObjUpvalue* upvalues[];
+    Value upvalues[];       // either the captured value itself, or an ObjUpvalue box when reassigned
 };
 
 struct ObjClass {
@@ -78,6 +154,28 @@ struct ObjBoundMethod {
     Value method;  // function or closure
 };
 
+struct ObjList {
+    Obj obj;
+    ValueArray items;
+};
+
+// fixed-length array of raw doubles, boxed only when an element is read
+struct ObjFloatArray {
+    Obj obj;
+    uint32_t length;
+    double values[];
+};
+
+struct ObjMap {
+    Obj obj;
+    ValueTable table;
+};
+
+struct ObjOrderedMap {
+    Obj obj;
+    BTree tree;
+};
+
 #define OBJ_TYPE(value)         (AS_OBJ(value)->type)
 
 #define IS_STRING(value)        (is_obj_type(value, OBJ_STRING))
@@ -105,7 +203,35 @@ struct ObjBoundMethod {
 #define IS_BOUND_METHOD(value)  (is_obj_type(value, OBJ_BOUND_METHOD))
 #define AS_BOUND_METHOD(value)  ((ObjBoundMethod*) AS_OBJ(value))
 
+#define IS_LIST(value)          (is_obj_type(value, OBJ_LIST))
+#define AS_LIST(value)          ((ObjList*) AS_OBJ(value))
+
+#define IS_FLOAT_ARRAY(value)   (is_obj_type(value, OBJ_FLOAT_ARRAY))
+#define AS_FLOAT_ARRAY(value)   ((ObjFloatArray*) AS_OBJ(value))
+
+#define IS_MAP(value)           (is_obj_type(value, OBJ_MAP))
+#define AS_MAP(value)           ((ObjMap*) AS_OBJ(value))
+
+#define IS_ORDERED_MAP(value)   (is_obj_type(value, OBJ_ORDERED_MAP))
+#define AS_ORDERED_MAP(value)   ((ObjOrderedMap*) AS_OBJ(value))
+
+#define IS_ROPE(value)          (is_obj_type(value, OBJ_ROPE))
+#define AS_ROPE(value)          ((ObjRope*) AS_OBJ(value))
+
+#define IS_SLICE(value)         (is_obj_type(value, OBJ_SLICE))
+#define AS_SLICE(value)         ((ObjSlice*) AS_OBJ(value))
+
 #define STRING_MAX_LEN          0x7FFFFF00
+#define FLOAT_ARRAY_MAX_LEN     0x0FFFFFFF
+
+// shorter concatenations are copied straight away, as a rope would cost more than the copy
+#define ROPE_MIN_LEN            64
+
+// shorter substrings are copied, as a slice would cost as much as the copy
+// slices of large parents are also copied when much shorter, so as not to keep the parent alive
+#define SLICE_MIN_LEN           16
+#define SLICE_LARGE_PARENT      4096
+#define SLICE_MAX_WASTE         8
 
 
 // inlined for fast-path
@@ -113,18 +239,78 @@ inline static bool is_obj_type(Value value, ObjType type) {
     return IS_OBJ(value) && OBJ_TYPE(value) == type;
 }
 
+inline static bool is_string_like(Value value) {
+    if (IS_SHORT_STRING(value)) return true;
+    if (!IS_OBJ(value)) return false;
+    ObjType type = OBJ_TYPE(value);
+    return type == OBJ_STRING || type == OBJ_ROPE || type == OBJ_SLICE;
+}
+
+// strings which must be flattened before they can be hashed or compared by identity
+inline static bool is_lazy_string(Value value) {
+    if (!IS_OBJ(value)) return false;
+    switch (OBJ_TYPE(value)) {
+        case OBJ_STRING: return !AS_STRING(value)->interned;
+        case OBJ_ROPE: return true;
+        case OBJ_SLICE: return true;
+        default: return false;
+    }
+}
+
+inline static uint32_t string_length(Value value) {
+    if (IS_SHORT_STRING(value)) return SHORT_STRING_LENGTH(value);
+    if (IS_ROPE(value)) return AS_ROPE(value)->length;
+    if (IS_SLICE(value)) return AS_SLICE(value)->length;
+    return AS_STRING(value)->length;
+}
+
+inline static const char* slice_chars(ObjSlice* slice) {
+    return slice->flat ? slice->flat->chars : slice->parent->chars + slice->start;
+}
+
+// chars of a string, short string or slice, unpacking short strings into buffer[SHORT_STRING_BUFFER]
+// only terminated for strings
+inline static const char* string_chars(Value value, char* buffer) {
+    if (IS_SHORT_STRING(value)) {
+        short_string_chars(value, buffer);
+        return buffer;
+    }
+    if (IS_SLICE(value)) return slice_chars(AS_SLICE(value));
+    return AS_STRING(value)->chars;
+}
+
 Obj* alloc_object(size_t size, ObjType type);
 void free_object(Obj* object);
 void mark_object(Obj* object);
 
+uint32_t hash_string(const char* key, int length);
 Value string_value(VM* vm, const char* str, int length);
+Value make_string(VM* vm, const char* str, int length);
+Value runtime_string(VM* vm, const char* str, int length);
+ObjString* intern_string(VM* vm, ObjString* string);
+Value build_string(VM* vm, Value* parts, int count);
+ObjString* start_string(int length);
+Value finish_string(VM* vm, ObjString* string);
+void copy_chars(Value string, char* dest);      // any kind of string, into dest[string_length()]
 Value concatenate_strings(VM* vm, Value a, Value b);
+Value concatenate_lazily(VM* vm, Value a, Value b);
+void rope_chars(ObjRope* rope, char* dest);
+ObjString* flatten_rope(VM* vm, ObjRope* rope);
+Value substring(VM* vm, Value string, uint32_t start, uint32_t length);
+ObjString* flatten_slice(VM* vm, ObjSlice* slice);
 
 ObjFunction* new_function(VM* vm);
-Value define_native(VM* vm, const char* name, NativeFn fn);
+Value define_native(VM* vm, const char* name, NativeFn fn, int arity);
+Value define_view_native(VM* vm, const char* name, NativeFn fn, int arity);
+Value define_native(VM* vm, const char* name, NativeNumberFn1 fn);
+Value define_native(VM* vm, const char* name, NativeNumberFn2 fn);
 
 ObjClosure* new_closure(VM* vm, ObjFunction* fn);
 ObjUpvalue* new_upvalue(VM* vm, Value* value);
 ObjClass* new_class(VM* vm, ObjString* name);
 ObjInstance* new_instance(VM* vm, ObjClass* klass);
 ObjBoundMethod* new_bound_method(VM* vm, Value receiver, Value method);
+ObjList* new_list(VM* vm);
+ObjFloatArray* new_float_array(VM* vm, int length);
+ObjMap* new_map(VM* vm);
+ObjOrderedMap* new_ordered_map(VM* vm);
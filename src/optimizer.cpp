@@ -0,0 +1,494 @@
+#include "optimizer.h"
+#include "object.h"
+#include "memory.h"
+#include "vm.h"
+#include "debug.h"
+
+#include <assert.h>
+#include <string.h>
+
+// The optimizer rewrites the bytecode of a hot function in place.
+//
+// Code is decoded into a list of instructions and split into basic blocks.  Each block is
+// optimized on its own, then re-encoded into exactly the bytes it used to occupy, padding
+// the remainder with OP_NOP or jumping over it.  Jump targets and return addresses start
+// blocks, so they keep their offsets.  Frames that are already executing the function
+// continue to run correctly, and the line table still maps every byte to its source line.
+//
+// Only rewrites which can never change behavior are applied.  Folding is limited to numbers,
+// and no instruction which may raise a runtime error is removed or reordered, so errors
+// and stack traces are identical before and after optimization.
+//
+// The one speculative rewrite embeds the value of a global which has only been assigned once,
+// replacing OP_GET_GLOBAL with OP_CONSTANT of the same length.  The VM records where this was
+// done, and restores the original instruction as soon as the global is assigned again.
+
+struct Inst {
+    uint8_t op;         // base opcode of a variable-length family, e.g. OP_GET_LOCAL for OP_GET_LOCAL_16
+    int operand;        // constant, local or upvalue index, argc, or pop count
+    int offset;         // offset in original code
+    int length;         // length of original encoding, or 0 when created by the optimizer
+    int line;
+    int target;         // absolute offset of jump target
+};
+
+static bool is_variable_length(uint8_t op) {
+    return op >= OP_CONSTANT && op <= OP_GET_SUPER_24;
+}
+
+static Inst decode(Chunk* chunk, int offset) {
+    Inst inst;
+    uint8_t* code = chunk->code;
+    uint8_t op = code[offset];
+
+    inst.op = op;
+    inst.operand = 0;
+    inst.offset = offset;
+    inst.length = chunk->instruction_length(offset);
+    inst.line = chunk->lines[offset];
+    inst.target = -1;
+
+    if (is_variable_length(op)) {
+        int width = (op - OP_CONSTANT) % 3 + 1;
+        inst.op = op - (width - 1);
+        inst.operand = code[offset + 1];
+        if (width > 1) inst.operand |= code[offset + 2] << 8;
+        if (width > 2) inst.operand |= code[offset + 3] << 16;
+    } else if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE) {
+        int16_t jump = code[offset + 1];
+        jump |= code[offset + 2] << 8;
+        inst.target = offset + 3 + jump;
+    } else if (op == OP_POPN || op == OP_CALL) {
+        inst.operand = code[offset + 1];
+    }
+
+    return inst;
+}
+
+// instructions after which a new block must start
+static bool ends_block(uint8_t op) {
+    switch (op) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+        case OP_RETURN:
+        case OP_CALL:           // frames resume after calls
+        case OP_INVOKE:
+        case OP_INVOKE_SUPER:
+        case OP_INVOKE_CACHED:
+        case OP_INTRINSIC:      // may fall back to a call
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_pure_push(uint8_t op) {
+    switch (op) {
+        case OP_NIL:
+        case OP_FALSE:
+        case OP_TRUE:
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_GET_UPVALUE:
+        case OP_DUP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static Inst make_inst(uint8_t op, int operand, int line) {
+    Inst inst;
+    inst.op = op;
+    inst.operand = operand;
+    inst.offset = -1;
+    inst.length = 0;
+    inst.line = line;
+    inst.target = -1;
+    return inst;
+}
+
+// return index of a number constant which fits in an 8-bit operand, or -1
+// compares bits rather than values, so that 0 and -0 remain distinct
+static int number_constant(Chunk* chunk, double number) {
+    for (int i = 0; i < chunk->constants.length && i < 256; i++) {
+        Value value = chunk->constants.values[i];
+        if (!IS_NUMBER(value)) continue;
+        double existing = AS_NUMBER(value);
+        if (memcmp(&existing, &number, sizeof(double)) == 0) return i;
+    }
+    if (chunk->constants.length >= 256) return -1;
+    chunk->constants.write(NUMBER_VAL(number));
+    return chunk->constants.length - 1;
+}
+
+// return index of any constant which fits in an 8-bit operand, or -1
+static int value_constant(Chunk* chunk, Value value) {
+    if (IS_NUMBER(value)) return number_constant(chunk, AS_NUMBER(value));
+
+    for (int i = 0; i < chunk->constants.length && i < 256; i++) {
+        if (!IS_NUMBER(chunk->constants.values[i]) && values_equal(chunk->constants.values[i], value)) return i;
+    }
+    if (chunk->constants.length >= 256) return -1;
+    chunk->constants.write(value);
+    return chunk->constants.length - 1;
+}
+
+static bool is_number_constant(Chunk* chunk, Inst* inst) {
+    return inst->op == OP_CONSTANT && IS_NUMBER(chunk->constants.values[inst->operand]);
+}
+
+static double constant_number(Chunk* chunk, Inst* inst) {
+    return AS_NUMBER(chunk->constants.values[inst->operand]);
+}
+
+// replace count instructions at index with a single instruction
+static void replace(Inst* insts, int* count, int index, int n, Inst inst) {
+    insts[index] = inst;
+    memmove(&insts[index + 1], &insts[index + n], (*count - index - n) * sizeof(Inst));
+    *count -= n - 1;
+}
+
+static void remove_insts(Inst* insts, int* count, int index, int n) {
+    memmove(&insts[index], &insts[index + n], (*count - index - n) * sizeof(Inst));
+    *count -= n;
+}
+
+// constant folding of number arithmetic and comparison, and of 'not' on literals
+static bool fold_constants(Chunk* chunk, Inst* insts, int* count) {
+    bool changed = false;
+
+    for (int i = 0; i + 1 < *count; i++) {
+        Inst* a = &insts[i];
+        Inst* b = &insts[i + 1];
+
+        if (i + 2 < *count && is_number_constant(chunk, a) && is_number_constant(chunk, b)) {
+            Inst* op = &insts[i + 2];
+            double x = constant_number(chunk, a);
+            double y = constant_number(chunk, b);
+            int line = op->line;
+            int constant = -1;
+            uint8_t result = OP_NOP;
+
+            switch (op->op) {
+                case OP_ADD:
+                case OP_ADD_NN:     constant = number_constant(chunk, x + y); break;
+                case OP_SUBTRACT:
+                case OP_SUBTRACT_NN: constant = number_constant(chunk, x - y); break;
+                case OP_MULTIPLY:
+                case OP_MULTIPLY_NN: constant = number_constant(chunk, x * y); break;
+                case OP_DIVIDE:
+                case OP_DIVIDE_NN:  constant = number_constant(chunk, x / y); break;
+                case OP_LESS:
+                case OP_LESS_NN:    result = x < y ? OP_TRUE : OP_FALSE; break;
+                case OP_GREATER:
+                case OP_GREATER_NN: result = x > y ? OP_TRUE : OP_FALSE; break;
+                case OP_EQUAL:      result = x == y ? OP_TRUE : OP_FALSE; break;
+                default: break;
+            }
+
+            if (constant >= 0) {
+                replace(insts, count, i, 3, make_inst(OP_CONSTANT, constant, line));
+                changed = true;
+                continue;
+            } else if (result != OP_NOP) {
+                replace(insts, count, i, 3, make_inst(result, 0, line));
+                changed = true;
+                continue;
+            }
+        }
+
+        if (b->op == OP_NEGATE && is_number_constant(chunk, a)) {
+            int constant = number_constant(chunk, -constant_number(chunk, a));
+            if (constant >= 0) {
+                replace(insts, count, i, 2, make_inst(OP_CONSTANT, constant, b->line));
+                changed = true;
+            }
+        } else if (b->op == OP_NOT) {
+            Value value;
+            switch (a->op) {
+                case OP_NIL:        value = NIL_VAL; break;
+                case OP_FALSE:      value = BOOL_VAL(false); break;
+                case OP_TRUE:       value = BOOL_VAL(true); break;
+                case OP_CONSTANT:   value = chunk->constants.values[a->operand]; break;
+                default: continue;
+            }
+            uint8_t result = is_truthy(value) ? OP_FALSE : OP_TRUE;
+            replace(insts, count, i, 2, make_inst(result, 0, b->line));
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// remove values which are pushed and immediately discarded
+static bool eliminate_dead_pushes(Inst* insts, int* count) {
+    bool changed = false;
+
+    for (int i = 0; i + 1 < *count; i++) {
+        Inst* a = &insts[i];
+        Inst* b = &insts[i + 1];
+        if (!is_pure_push(a->op)) continue;
+
+        if (b->op == OP_POP) {
+            remove_insts(insts, count, i, 2);
+            changed = true;
+            i = i > 0 ? i - 2 : -1;
+        } else if (b->op == OP_POPN) {
+            int n = b->operand - 1;
+            Inst pop = n == 1 ? make_inst(OP_POP, 0, b->line) : make_inst(OP_POPN, n, b->line);
+            replace(insts, count, i, 2, pop);
+            changed = true;
+            i = i > 0 ? i - 2 : -1;
+        }
+    }
+
+    return changed;
+}
+
+// common subexpressions: reload of a variable just stored, or loaded twice in a row
+static bool eliminate_redundant_loads(Inst* insts, int* count) {
+    bool changed = false;
+
+    for (int i = 0; i + 1 < *count; i++) {
+        Inst* a = &insts[i];
+        Inst* b = &insts[i + 1];
+
+        if (i + 2 < *count && b->op == OP_POP) {
+            Inst* c = &insts[i + 2];
+            bool reload = (a->op == OP_SET_LOCAL && c->op == OP_GET_LOCAL) ||
+                          (a->op == OP_SET_UPVALUE && c->op == OP_GET_UPVALUE) ||
+                          (a->op == OP_SET_GLOBAL && c->op == OP_GET_GLOBAL);
+            if (reload && a->operand == c->operand) {
+                // the stored value is still on the stack
+                remove_insts(insts, count, i + 1, 2);
+                changed = true;
+                continue;
+            }
+        }
+
+        bool repeat = (a->op == OP_GET_LOCAL || a->op == OP_GET_UPVALUE) &&
+                      a->op == b->op && a->operand == b->operand;
+        if (repeat) {
+            insts[i + 1] = make_inst(OP_DUP, 0, b->line);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+// stores to locals which are never read, and not captured by a closure
+static bool eliminate_dead_stores(Inst* insts, int* count, bool* slot_read, int slot_count) {
+    bool changed = false;
+
+    for (int i = 0; i + 1 < *count; i++) {
+        Inst* a = &insts[i];
+        Inst* b = &insts[i + 1];
+        if (a->op != OP_SET_LOCAL || (b->op != OP_POP && b->op != OP_POPN)) continue;
+        if (slot_read == NULL || (a->operand < slot_count && slot_read[a->operand])) continue;
+
+        remove_insts(insts, count, i, 1);
+        changed = true;
+    }
+
+    return changed;
+}
+
+static void optimize_block(Chunk* chunk, Inst* insts, int* count, bool* slot_read, int slot_count) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        changed |= fold_constants(chunk, insts, count);
+        changed |= eliminate_dead_stores(insts, count, slot_read, slot_count);
+        changed |= eliminate_dead_pushes(insts, count);
+        changed |= eliminate_redundant_loads(insts, count);
+    }
+}
+
+// write instructions of a block back into the original bytes from start to end
+static void encode_block(Chunk* chunk, Inst* insts, int count, int start, int end) {
+    uint8_t* code = chunk->code;
+    int* lines = chunk->lines;
+    int pos = start;
+
+    // copy unchanged instructions first, working from a snapshot of the original bytes
+    uint8_t* original = ALLOC_ARRAY(uint8_t, end - start);
+    memcpy(original, code + start, end - start);
+
+    for (int i = 0; i < count; i++) {
+        Inst* inst = &insts[i];
+        int inst_start = pos;
+
+        if (inst->target >= 0) {
+            int jump = inst->target - (pos + 3);
+            code[pos++] = inst->op;
+            code[pos++] = jump & 0xFF;
+            code[pos++] = (jump >> 8) & 0xFF;
+        } else if (inst->length > 0) {
+            memcpy(code + pos, original + (inst->offset - start), inst->length);
+            pos += inst->length;
+        } else {
+            code[pos++] = inst->op;
+            if (inst->op == OP_CONSTANT || inst->op == OP_POPN) {
+                assert(inst->operand < 256);
+                code[pos++] = inst->operand;
+            }
+        }
+
+        for (int b = inst_start; b < pos; b++) {
+            lines[b] = inst->line;
+        }
+    }
+
+    FREE_ARRAY(uint8_t, original, end - start);
+    assert(pos <= end);
+
+    // fill the bytes which are no longer needed
+    int line = count > 0 ? insts[count - 1].line : lines[start];
+    bool falls_through = count == 0 || (insts[count - 1].op != OP_JUMP && insts[count - 1].op != OP_RETURN);
+    if (falls_through && end - pos >= 3) {
+        int jump = end - (pos + 3);
+        lines[pos] = lines[pos + 1] = lines[pos + 2] = line;
+        code[pos++] = OP_JUMP;
+        code[pos++] = jump & 0xFF;
+        code[pos++] = (jump >> 8) & 0xFF;
+    }
+    while (pos < end) {
+        lines[pos] = line;
+        code[pos++] = OP_NOP;
+    }
+}
+
+// embed values of globals assigned only once, in count instructions of an encoded block
+static void quicken_globals(VM* vm, ObjFunction* fn, int offset, int count) {
+    Chunk* chunk = &fn->chunk;
+    for (int i = 0; i < count; i++, offset += chunk->instruction_length(offset)) {
+        if (chunk->code[offset] != OP_GET_GLOBAL) continue;
+
+        uint8_t name_constant = chunk->code[offset + 1];
+        ObjString* name = AS_STRING(chunk->constants.values[name_constant]);
+        Value value;
+        if (!vm->get_global_once(name, &value)) continue;
+
+        int constant = value_constant(chunk, value);
+        if (constant < 0) return;
+
+        chunk->code[offset] = OP_CONSTANT;
+        chunk->code[offset + 1] = constant;
+        vm->add_global_dependency(name, fn, offset, name_constant);
+    }
+}
+
+// follow chains of unconditional jumps
+static void thread_jumps(Inst* insts, int count, int* index_at, int length) {
+    for (int i = 0; i < count; i++) {
+        Inst* inst = &insts[i];
+        if (inst->target < 0) continue;
+
+        int target = inst->target;
+        for (int hops = 0; hops < 8 && target < length; hops++) {
+            Inst* next = &insts[index_at[target]];
+            if (next->op != OP_JUMP || next->target == target) break;
+            target = next->target;
+        }
+
+        int jump = target - (inst->offset + 3);
+        if (jump >= INT16_MIN && jump <= INT16_MAX) {
+            inst->target = target;
+        }
+    }
+}
+
+void optimize_function(VM* vm, ObjFunction* fn) {
+    if (fn->optimized) return;
+    fn->optimized = true;
+
+    Chunk* chunk = &fn->chunk;
+    int length = chunk->length;
+    if (length == 0) return;
+
+    // decode all instructions
+    Inst* insts = ALLOC_ARRAY(Inst, length);
+    int* index_at = ALLOC_ARRAY(int, length + 1);
+    bool* leader = ALLOC_ARRAY(bool, length + 1);
+    memset(leader, 0, (length + 1) * sizeof(bool));
+
+    int count = 0;
+    int slot_count = 0;
+    for (int offset = 0; offset < length; ) {
+        Inst inst = decode(chunk, offset);
+        index_at[offset] = count;
+        insts[count++] = inst;
+
+        if (inst.target >= 0) leader[inst.target] = true;
+        if (ends_block(inst.op)) leader[offset + inst.length] = true;
+        if (inst.op == OP_GET_LOCAL && inst.operand >= slot_count) slot_count = inst.operand + 1;
+
+        offset += inst.length;
+    }
+    index_at[length] = count;
+    leader[0] = true;
+
+    // find locals which are read, either directly or by closures
+    bool* slot_read = ALLOC_ARRAY(bool, slot_count + 1);
+    memset(slot_read, 0, (slot_count + 1) * sizeof(bool));
+    bool any_closures = false;
+    for (int i = 0; i < count; i++) {
+        Inst* inst = &insts[i];
+        if (inst->op == OP_GET_LOCAL) {
+            slot_read[inst->operand] = true;
+        } else if (inst->op == OP_CLOSURE) {
+            any_closures = true;
+        }
+    }
+
+    // closures capture by stack slot - be conservative and keep all stores
+    bool* dead_store_slots = any_closures ? NULL : slot_read;
+
+    thread_jumps(insts, count, index_at, length);
+
+    // give each method invocation an inline cache
+    for (int i = 0; i < count; i++) {
+        Inst* inst = &insts[i];
+        if (inst->op != OP_INVOKE || inst->length != 3) continue;
+        int cache = chunk->add_inline_cache(inst->operand);
+        if (cache < 0) break;
+
+        // rewrite the original bytes, which are copied as-is when blocks are encoded
+        chunk->code[inst->offset] = OP_INVOKE_CACHED;
+        chunk->code[inst->offset + 1] = cache;
+    }
+
+    // optimize each block
+    Inst* block = ALLOC_ARRAY(Inst, count);
+    for (int first = 0; first < count; ) {
+        int last = first + 1;
+        while (last < count && !leader[insts[last].offset]) last++;
+
+        int block_count = last - first;
+        memcpy(block, &insts[first], block_count * sizeof(Inst));
+        optimize_block(chunk, block, &block_count, dead_store_slots, slot_count);
+
+        int start = insts[first].offset;
+        int end = last < count ? insts[last].offset : length;
+        encode_block(chunk, block, block_count, start, end);
+        quicken_globals(vm, fn, start, block_count);
+
+        first = last;
+    }
+
+    FREE_ARRAY(Inst, block, count);
+    FREE_ARRAY(bool, slot_read, slot_count + 1);
+    FREE_ARRAY(bool, leader, length + 1);
+    FREE_ARRAY(int, index_at, length + 1);
+    FREE_ARRAY(Inst, insts, length);
+
+    if (vm->is_debug_mode()) {
+        const char* name = fn->name ? fn->name->chars : "<script>";
+        printf("-- optimized --\n");
+        print_chunk(chunk, name);
+    }
+}
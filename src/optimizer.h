@@ -0,0 +1,11 @@
+#pragma once
+
+#include "common.h"
+
+struct VM;
+struct ObjFunction;
+
+// functions are optimized once they have been called or looped this many times
+#define HOT_FUNCTION_THRESHOLD  1000
+
+void optimize_function(VM* vm, ObjFunction* fn);
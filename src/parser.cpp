@@ -97,6 +97,7 @@ bool Parser::synchronize() {
         if (previous.type == TOKEN_SEMICOLON) return true;
         switch (current.type) {
             case TOKEN_CLASS:
+            case TOKEN_CONST:
             case TOKEN_FUN:
             case TOKEN_VAR:
             case TOKEN_FOR:
@@ -0,0 +1,621 @@
+#include "regex.h"
+#include "memory.h"
+#include "object.h"
+
+#include <string.h>
+#include <new>
+
+Nfa::Nfa() {
+    this->states = NULL;
+    this->count = 0;
+    this->capacity = 0;
+}
+
+Nfa::~Nfa() {
+    FREE_ARRAY(NfaState, states, capacity);
+}
+
+int Nfa::add(NfaKind kind) {
+    if (count == capacity) {
+        int old_capacity = capacity;
+        capacity = GROW_CAPACITY(old_capacity);
+        states = GROW_ARRAY(NfaState, states, old_capacity, capacity);
+    }
+    NfaState* state = &states[count];
+    state->kind = kind;
+    state->out = -1;
+    state->out2 = -1;
+    memset(state->set, 0, sizeof(state->set));
+    return count++;
+}
+
+
+//
+// Compiling patterns, into NFAs built of fragments as in Thompson's construction.  The outs of
+// a fragment which are still to be patched are chained through themselves, each holding the
+// next, as a slot of 2 * state + 1 for out2, or 2 * state for out.
+//
+
+struct Fragment {
+    int start;
+    int head;       // first slot to patch, or -1 if none
+    int tail;
+};
+
+struct RegexParser {
+    const char* current;
+    const char* end;
+    Nfa* nfa;
+    bool reversed;      // concatenate backwards, for matching from the end of a match
+    int depth;
+    bool anchored;      // by '^' or '$', which apply to the whole pattern, so alternatives must be grouped
+    const char* error;
+};
+
+static int* slot(Nfa* nfa, int s) {
+    NfaState* state = &nfa->states[s >> 1];
+    return (s & 1) ? &state->out2 : &state->out;
+}
+
+static void patch(Nfa* nfa, Fragment* f, int target) {
+    for (int s = f->head; s != -1; ) {
+        int* out = slot(nfa, s);
+        s = *out;
+        *out = target;
+    }
+}
+
+static void append_outs(Nfa* nfa, Fragment* f, int head, int tail) {
+    if (head == -1) return;
+    if (f->head == -1) {
+        f->head = head;
+    } else {
+        *slot(nfa, f->tail) = head;
+    }
+    f->tail = tail;
+}
+
+static Fragment fragment(Nfa* nfa, NfaKind kind) {
+    int state = nfa->add(kind);
+    Fragment f = { state, 2 * state, 2 * state };
+    return f;
+}
+
+static void add_char(uint64_t* set, uint8_t c) {
+    set[c >> 6] |= (uint64_t) 1 << (c & 63);
+}
+
+static void add_range(uint64_t* set, uint8_t low, uint8_t high) {
+    for (int c = low; c <= high; c++) add_char(set, c);
+}
+
+static bool is_special(char c) {
+    return c != '\0' && strchr("\\.[]()|*+?^$", c) != NULL;
+}
+
+// add the chars of a \d, \w or \s class, returning false for other escapes
+static bool add_class(uint64_t* set, char c) {
+    uint64_t chars[4] = {};
+    switch (c) {
+        case 'd': case 'D':
+            add_range(chars, '0', '9');
+            break;
+        case 'w': case 'W':
+            add_range(chars, '0', '9');
+            add_range(chars, 'A', 'Z');
+            add_range(chars, 'a', 'z');
+            add_char(chars, '_');
+            break;
+        case 's': case 'S':
+            add_char(chars, ' ');
+            add_range(chars, '\t', '\r');
+            break;
+        default:
+            return false;
+    }
+    bool negated = c >= 'A' && c <= 'Z';
+    for (int i = 0; i < 4; i++) set[i] |= negated ? ~chars[i] : chars[i];
+    return true;
+}
+
+// char of an escape, after the backslash, or -1 if it isn't a single char
+static int escaped_char(RegexParser* parser, char c) {
+    switch (c) {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+    }
+    if (!is_special(c) && c != '-') {
+        parser->error = "unknown escape";
+        return -1;
+    }
+    return (uint8_t) c;
+}
+
+static bool parse_set(RegexParser* parser, uint64_t* set) {
+    bool negated = parser->current < parser->end && *parser->current == '^';
+    if (negated) parser->current++;
+
+    bool first = true;
+    while (true) {
+        if (parser->current == parser->end) {
+            parser->error = "missing ']'";
+            return false;
+        }
+        char c = *parser->current++;
+        if (c == ']' && !first) break;
+        first = false;
+
+        int low = (uint8_t) c;
+        if (c == '\\') {
+            if (parser->current == parser->end) continue;
+            c = *parser->current++;
+            if (add_class(set, c)) continue;
+            low = escaped_char(parser, c);
+            if (low < 0) return false;
+        }
+
+        int high = low;
+        if (parser->end - parser->current >= 2 && parser->current[0] == '-' && parser->current[1] != ']') {
+            parser->current++;
+            c = *parser->current++;
+            high = (uint8_t) c;
+            if (c == '\\') {
+                if (parser->current == parser->end) continue;
+                high = escaped_char(parser, *parser->current++);
+                if (high < 0) return false;
+            }
+            if (high < low) {
+                parser->error = "invalid range";
+                return false;
+            }
+        }
+        add_range(set, low, high);
+    }
+
+    if (negated) {
+        for (int i = 0; i < 4; i++) set[i] = ~set[i];
+    }
+    return true;
+}
+
+static bool parse_alternation(RegexParser* parser, Fragment* out);
+
+static bool parse_atom(RegexParser* parser, Fragment* out) {
+    Nfa* nfa = parser->nfa;
+    char c = *parser->current++;
+    switch (c) {
+        case '(': {
+            if (++parser->depth > REGEX_MAX_DEPTH) {
+                parser->error = "groups nested too deeply";
+                return false;
+            }
+            if (!parse_alternation(parser, out)) return false;
+            if (parser->current == parser->end || *parser->current != ')') {
+                parser->error = "missing ')'";
+                return false;
+            }
+            parser->current++;
+            parser->depth--;
+            return true;
+        }
+        case '*': case '+': case '?':
+            parser->error = "nothing to repeat";
+            return false;
+        case '^': case '$':
+            parser->error = "'^' and '$' may only begin and end the pattern";
+            return false;
+        case '.':
+            *out = fragment(nfa, NFA_CHARS);
+            memset(nfa->states[out->start].set, 0xFF, sizeof(nfa->states[out->start].set));
+            return true;
+        case '[':
+            *out = fragment(nfa, NFA_CHARS);
+            return parse_set(parser, nfa->states[out->start].set);
+        case '\\': {
+            if (parser->current == parser->end) {
+                parser->error = "trailing '\\'";
+                return false;
+            }
+            c = *parser->current++;
+            *out = fragment(nfa, NFA_CHARS);
+            if (add_class(nfa->states[out->start].set, c)) return true;
+            int escaped = escaped_char(parser, c);
+            if (escaped < 0) return false;
+            add_char(nfa->states[out->start].set, escaped);
+            return true;
+        }
+        default:
+            *out = fragment(nfa, NFA_CHARS);
+            add_char(nfa->states[out->start].set, c);
+            return true;
+    }
+}
+
+static bool parse_repeat(RegexParser* parser, Fragment* out) {
+    if (!parse_atom(parser, out)) return false;
+
+    Nfa* nfa = parser->nfa;
+    while (parser->current < parser->end) {
+        char c = *parser->current;
+        if (c != '*' && c != '+' && c != '?') break;
+        parser->current++;
+
+        int split = nfa->add(NFA_SPLIT);
+        nfa->states[split].out = out->start;
+        switch (c) {
+            case '*':
+                patch(nfa, out, split);
+                *out = { split, 2 * split + 1, 2 * split + 1 };
+                break;
+            case '+':
+                patch(nfa, out, split);
+                *out = { out->start, 2 * split + 1, 2 * split + 1 };
+                break;
+            case '?':
+                out->start = split;
+                append_outs(nfa, out, 2 * split + 1, 2 * split + 1);
+                break;
+        }
+    }
+    return true;
+}
+
+static bool parse_concatenation(RegexParser* parser, Fragment* out) {
+    Nfa* nfa = parser->nfa;
+    bool empty = true;
+    while (parser->current < parser->end && *parser->current != '|' && *parser->current != ')') {
+        Fragment piece;
+        if (!parse_repeat(parser, &piece)) return false;
+        if (empty) {
+            *out = piece;
+            empty = false;
+        } else if (parser->reversed) {
+            patch(nfa, &piece, out->start);
+            out->start = piece.start;
+        } else {
+            patch(nfa, out, piece.start);
+            out->head = piece.head;
+            out->tail = piece.tail;
+        }
+    }
+    if (empty) *out = fragment(nfa, NFA_EMPTY);
+    return true;
+}
+
+static bool parse_alternation(RegexParser* parser, Fragment* out) {
+    if (!parse_concatenation(parser, out)) return false;
+
+    Nfa* nfa = parser->nfa;
+    while (parser->current < parser->end && *parser->current == '|') {
+        if (parser->anchored && parser->depth == 0) {
+            parser->error = "'^' and '$' apply to the whole pattern, so '|' must be inside a group";
+            return false;
+        }
+        parser->current++;
+        Fragment right;
+        if (!parse_concatenation(parser, &right)) return false;
+        int split = nfa->add(NFA_SPLIT);
+        nfa->states[split].out = out->start;
+        nfa->states[split].out2 = right.start;
+        out->start = split;
+        append_outs(nfa, out, right.head, right.tail);
+    }
+    return true;
+}
+
+// compile the pattern into nfa, returning its start, or -1 after setting error
+static int compile_nfa(Nfa* nfa, const char* pattern, int length, bool reversed, bool anchored, const char** error) {
+    RegexParser parser = { pattern, pattern + length, nfa, reversed, 0, anchored, NULL };
+    Fragment f;
+    if (parse_alternation(&parser, &f) && parser.current < parser.end) {
+        parser.error = "unexpected ')'";
+    }
+    if (!parser.error && nfa->count >= REGEX_MAX_STATES) {
+        parser.error = "pattern too long";
+    }
+    if (parser.error) {
+        *error = parser.error;
+        return -1;
+    }
+    patch(nfa, &f, nfa->add(NFA_MATCH));
+    return f.start;
+}
+
+
+//
+// Lazy DFA.  Each state is the list of NFA states of the threads alive, in order of priority,
+// and its transitions are only built when first taken.  When too many states have been built
+// they are all dropped, so memory stays bounded, and scanning goes on by building them again.
+//
+
+Dfa::Dfa() {
+    this->nfa = NULL;
+    this->states = NULL;
+    this->state_count = 0;
+    this->state_capacity = 0;
+    this->threads = NULL;
+    this->thread_count = 0;
+    this->thread_capacity = 0;
+    this->scratch = NULL;
+    this->stack = NULL;
+    this->marks = NULL;
+}
+
+Dfa::~Dfa() {
+    FREE_ARRAY(DfaState, states, state_capacity);
+    FREE_ARRAY(int, threads, thread_capacity);
+    if (nfa) {
+        FREE_ARRAY(int, scratch, nfa->count);
+        FREE_ARRAY(int, stack, 2 * nfa->count + 1);
+        FREE_ARRAY(uint32_t, marks, nfa->count);
+    }
+}
+
+void Dfa::init(Nfa* nfa, int start, bool first_match) {
+    this->nfa = nfa;
+    this->start = start;
+    this->first_match = first_match;
+    this->scratch = ALLOC_ARRAY(int, nfa->count);
+    this->stack = ALLOC_ARRAY(int, 2 * nfa->count + 1);
+    this->marks = ALLOC_ARRAY(uint32_t, nfa->count);
+    memset(marks, 0, sizeof(uint32_t) * nfa->count);
+    this->generation = 0;
+    this->flush_count = 0;
+    flush();
+}
+
+void Dfa::flush() {
+    flush_count++;
+    state_count = 0;
+    thread_count = 0;
+    start_index = DFA_UNKNOWN;
+    memset(buckets, -1, sizeof(buckets));
+}
+
+// add the threads reached from an NFA state without consuming a char, in order of priority
+void Dfa::add_thread(int nfa_state) {
+    int top = 0;
+    stack[top++] = nfa_state;
+    while (top > 0) {
+        int s = stack[--top];
+        if (marks[s] == generation) continue;
+        marks[s] = generation;
+
+        NfaState* state = &nfa->states[s];
+        switch (state->kind) {
+            case NFA_SPLIT:
+                stack[top++] = state->out2;
+                stack[top++] = state->out;
+                break;
+            case NFA_EMPTY:
+                stack[top++] = state->out;
+                break;
+            case NFA_CHARS:
+            case NFA_MATCH:
+                scratch[scratch_count++] = s;
+                break;
+        }
+    }
+}
+
+static void start_threads(uint32_t* generation, uint32_t* marks, int count) {
+    if (++*generation == 0) {
+        memset(marks, 0, sizeof(uint32_t) * count);
+        *generation = 1;
+    }
+}
+
+// state of the threads in scratch, found if it was built already
+int Dfa::add_state() {
+    uint32_t hash = hash_string((const char*) scratch, scratch_count * sizeof(int));
+    int mask = 2 * REGEX_MAX_DFA_STATES - 1;
+    int bucket = hash & mask;
+    for (; buckets[bucket] != -1; bucket = (bucket + 1) & mask) {
+        DfaState* state = &states[buckets[bucket]];
+        if (state->count == scratch_count &&
+            memcmp(&threads[state->threads], scratch, scratch_count * sizeof(int)) == 0) {
+            return buckets[bucket];
+        }
+    }
+
+    if (state_count == REGEX_MAX_DFA_STATES) {
+        flush();
+        bucket = hash & mask;
+    }
+    if (state_count == state_capacity) {
+        int old_capacity = state_capacity;
+        state_capacity = GROW_CAPACITY(old_capacity);
+        states = GROW_ARRAY(DfaState, states, old_capacity, state_capacity);
+    }
+    if (thread_count + scratch_count > thread_capacity) {
+        int old_capacity = thread_capacity;
+        thread_capacity = GROW_CAPACITY(old_capacity);
+        if (thread_capacity < thread_count + scratch_count) thread_capacity = thread_count + scratch_count;
+        threads = GROW_ARRAY(int, threads, old_capacity, thread_capacity);
+    }
+
+    DfaState* state = &states[state_count];
+    state->threads = thread_count;
+    state->count = scratch_count;
+    state->match = false;
+    for (int i = 0; i < scratch_count; i++) {
+        if (nfa->states[scratch[i]].kind == NFA_MATCH) state->match = true;
+    }
+    for (int c = 0; c < 256; c++) state->next[c] = DFA_UNKNOWN;
+    memcpy(&threads[thread_count], scratch, scratch_count * sizeof(int));
+    thread_count += scratch_count;
+
+    buckets[bucket] = state_count;
+    return state_count++;
+}
+
+int Dfa::start_state() {
+    if (start_index == DFA_UNKNOWN) {
+        start_threads(&generation, marks, nfa->count);
+        scratch_count = 0;
+        add_thread(start);
+        start_index = add_state();
+    }
+    return start_index;
+}
+
+int Dfa::build_next(int state, uint8_t c) {
+    start_threads(&generation, marks, nfa->count);
+    scratch_count = 0;
+    DfaState* from = &states[state];
+    for (int i = 0; i < from->count; i++) {
+        NfaState* thread = &nfa->states[threads[from->threads + i]];
+        if (thread->kind == NFA_MATCH) {
+            // the threads after it could only find worse matches
+            if (first_match) break;
+            continue;
+        }
+        if (thread->set[c >> 6] & ((uint64_t) 1 << (c & 63))) {
+            add_thread(thread->out);
+        }
+    }
+
+    if (scratch_count == 0) {
+        states[state].next[c] = DFA_DEAD;
+        return DFA_DEAD;
+    }
+    int flushes = flush_count;
+    int result = add_state();
+    // unless all states were flushed to make room, the old one with them
+    if (flush_count == flushes) states[state].next[c] = result;
+    return result;
+}
+
+
+Regex::Regex() {
+    this->anchor_start = false;
+    this->anchor_end = false;
+}
+
+Regex::~Regex() {
+}
+
+const char* Regex::compile(const char* pattern, int length) {
+    // anchors are only allowed at the very ends, where they apply to the whole pattern, so unlike
+    // Perl ^a|b would mean ^(a|b), and is rejected
+    anchor_start = length > 0 && pattern[0] == '^';
+    if (anchor_start) {
+        pattern++;
+        length--;
+    }
+    int backslashes = 0;
+    while (backslashes < length - 1 && pattern[length - 2 - backslashes] == '\\') backslashes++;
+    anchor_end = length > 0 && pattern[length - 1] == '$' && backslashes % 2 == 0;
+    if (anchor_end) length--;
+
+    const char* error = NULL;
+    bool anchored = anchor_start || anchor_end;
+    int start = compile_nfa(&forward, pattern, length, false, anchored, &error);
+    if (start < 0) return error;
+    int reverse_start = compile_nfa(&reverse, pattern, length, true, anchored, &error);
+    if (reverse_start < 0) return error;
+
+    // unanchored searches start with a loop over any char, of lower priority than the pattern
+    int any = forward.add(NFA_CHARS);
+    memset(forward.states[any].set, 0xFF, sizeof(forward.states[any].set));
+    int loop = forward.add(NFA_SPLIT);
+    forward.states[loop].out = start;
+    forward.states[loop].out2 = any;
+    forward.states[any].out = loop;
+
+    full.init(&forward, start, false);
+    // a match must reach the end when anchored there, so earlier ones can't stop the search
+    searcher.init(&forward, anchor_start ? start : loop, !anchor_end);
+    backward.init(&reverse, reverse_start, false);
+    return NULL;
+}
+
+bool Regex::match(const char* text, int length) {
+    int state = full.start_state();
+    for (int i = 0; i < length; i++) {
+        state = full.next(state, text[i]);
+        if (state == DFA_DEAD) return false;
+    }
+    return full.is_match(state);
+}
+
+bool Regex::search(const char* text, int length, int from, int* match_start, int* match_end) {
+    if (anchor_start && from > 0) return false;
+
+    // find the end of the leftmost match, scanning on until no better one could be found
+    int end = -1;
+    int state = searcher.start_state();
+    if (searcher.is_match(state) && (!anchor_end || from == length)) end = from;
+    for (int i = from; i < length; i++) {
+        state = searcher.next(state, text[i]);
+        if (state == DFA_DEAD) break;
+        if (searcher.is_match(state) && (!anchor_end || i + 1 == length)) end = i + 1;
+    }
+    if (end < 0) return false;
+
+    // the leftmost match ending there starts at the furthest point the reversed pattern reaches
+    int start = end;
+    if (anchor_start) {
+        start = 0;
+    } else {
+        state = backward.start_state();
+        for (int i = end - 1; i >= from; i--) {
+            state = backward.next(state, text[i]);
+            if (state == DFA_DEAD) break;
+            if (backward.is_match(state)) start = i;
+        }
+    }
+
+    *match_start = start;
+    *match_end = end;
+    return true;
+}
+
+
+RegexCache::RegexCache() {
+    this->count = 0;
+}
+
+RegexCache::~RegexCache() {
+    for (int i = 0; i < count; i++) {
+        FREE_ARRAY(char, entries[i].pattern, entries[i].length);
+        entries[i].regex->~Regex();
+        FREE(Regex, entries[i].regex);
+    }
+}
+
+Regex* RegexCache::get(const char* pattern, int length, const char** error) {
+    for (int i = 0; i < count; i++) {
+        if (entries[i].length == length && memcmp(entries[i].pattern, pattern, length) == 0) {
+            RegexCacheEntry entry = entries[i];
+            memmove(&entries[1], &entries[0], sizeof(RegexCacheEntry) * i);
+            entries[0] = entry;
+            return entry.regex;
+        }
+    }
+
+    Regex* regex = ALLOC_ARRAY(Regex, 1);
+    new (regex) Regex();
+    *error = regex->compile(pattern, length);
+    if (*error) {
+        regex->~Regex();
+        FREE(Regex, regex);
+        return NULL;
+    }
+
+    // evict the least recently used
+    if (count == REGEX_CACHE_SIZE) {
+        count--;
+        FREE_ARRAY(char, entries[count].pattern, entries[count].length);
+        entries[count].regex->~Regex();
+        FREE(Regex, entries[count].regex);
+    }
+    memmove(&entries[1], &entries[0], sizeof(RegexCacheEntry) * count);
+    count++;
+    entries[0].pattern = ALLOC_ARRAY(char, length);
+    memcpy(entries[0].pattern, pattern, length);
+    entries[0].length = length;
+    entries[0].regex = regex;
+    return regex;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "common.h"
+
+// Regular expressions, matched in time linear in the length of the text by a DFA which is built
+// lazily from the NFA of the pattern, a state at a time as the text needs it.  The syntax is a
+// subset of RE2's, leaving out everything which would need backtracking:
+//
+//   x          a literal char, or \x for any of the special chars \ . [ ] ( ) | * + ? ^ $
+//   .          any char
+//   [abc]      any char of a set, which may hold ranges [a-z] and escapes, or [^abc] for any other
+//   \d \w \s   a digit, a word char [0-9A-Za-z_] or a space, or \D \W \S for any other char
+//   \n \t \r   newline, tab and carriage return
+//   xy  x|y    x followed by y, x or y
+//   x* x+ x?   zero or more x, one or more, zero or one, all greedy
+//   (x)        grouping, without capture
+//   ^x$        anchors, only at the very start and end of the whole pattern, and so only with
+//              alternatives inside a group, as in ^(x|y)$
+//
+// Searches find the leftmost match, and of the matches starting there the one a backtracking
+// matcher would: greedy operators take all they can and earlier alternatives win.  Except that a
+// loop never ends on an iteration which matched nothing, so (|a)* matches all of "aa" where Perl
+// matches "".
+
+#define REGEX_MAX_STATES        2000    // NFA states, which limits the length of patterns
+#define REGEX_MAX_DEPTH         100     // nesting of groups
+#define REGEX_MAX_DFA_STATES    256     // DFA states built before they are all flushed
+#define REGEX_CACHE_SIZE        32      // compiled patterns kept by each VM
+
+#define DFA_UNKNOWN             -2      // transition not built yet
+#define DFA_DEAD                -1      // no thread left, so going on can't find a match
+
+enum NfaKind {
+    NFA_CHARS,          // consume a char in set, then go to out
+    NFA_SPLIT,          // go to out, or with lower priority to out2
+    NFA_EMPTY,          // go to out
+    NFA_MATCH,
+};
+
+struct NfaState {
+    NfaKind kind;
+    int out;
+    int out2;
+    uint64_t set[4];    // bit per char
+};
+
+struct Nfa {
+    Nfa();
+    ~Nfa();
+
+    int add(NfaKind kind);
+
+    NfaState* states;
+    int count;
+    int capacity;
+};
+
+// set of NFA states which are alive at a point of the text, in order of priority
+struct DfaState {
+    int threads;        // index of the first in Dfa::threads
+    int count;
+    bool match;
+    int next[256];      // state after each char, or DFA_UNKNOWN or DFA_DEAD
+};
+
+struct Dfa {
+    Dfa();
+    ~Dfa();
+
+    // first_match drops threads of lower priority than a match, so that a search stops as soon as
+    // no better match can be found; otherwise all threads run, for the longest match
+    void init(Nfa* nfa, int start, bool first_match);
+
+    int start_state();
+    bool is_match(int state) { return states[state].match; }
+
+    // inlined for the scanning loops
+    int next(int state, uint8_t c) {
+        int result = states[state].next[c];
+        return result != DFA_UNKNOWN ? result : build_next(state, c);
+    }
+
+private:
+    int build_next(int state, uint8_t c);
+    void add_thread(int nfa_state);
+    int add_state();
+    void flush();
+
+    Nfa* nfa;
+    int start;
+    bool first_match;
+    int start_index;
+    int flush_count;
+
+    DfaState* states;
+    int state_count;
+    int state_capacity;
+    int* threads;
+    int thread_count;
+    int thread_capacity;
+    int buckets[2 * REGEX_MAX_DFA_STATES];     // index of state by hash of its threads, or -1
+
+    // threads of the state being built, and what has been added to them
+    int* scratch;
+    int scratch_count;
+    int* stack;
+    uint32_t* marks;
+    uint32_t generation;
+};
+
+struct Regex {
+    Regex();
+    ~Regex();
+
+    const char* compile(const char* pattern, int length);  // return error message, or NULL if compiled
+
+    bool match(const char* text, int length);              // true if all of text matches
+    // true if a match is found at or after from, which is then text[match_start .. match_end]
+    bool search(const char* text, int length, int from, int* match_start, int* match_end);
+
+private:
+    Nfa forward;
+    Nfa reverse;
+    bool anchor_start;
+    bool anchor_end;
+    Dfa full;           // anchored at both ends
+    Dfa searcher;       // finds where the leftmost match ends
+    Dfa backward;       // then finds where it starts, scanning back with the reversed pattern
+};
+
+struct RegexCacheEntry {
+    char* pattern;
+    int length;
+    Regex* regex;
+};
+
+// compiled patterns by their text, most recently used first
+struct RegexCache {
+    RegexCache();
+    ~RegexCache();
+
+    Regex* get(const char* pattern, int length, const char** error);   // NULL if the pattern is invalid
+
+private:
+    RegexCacheEntry entries[REGEX_CACHE_SIZE];
+    int count;
+};
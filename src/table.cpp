@@ -5,11 +5,65 @@
 
 #define TABLE_MAX_LOAD 0.75
 
+// Table shrinks below this load, to half of TABLE_MAX_LOAD or less, so that a table which grows
+// and shrinks by a few keys isn't resized back and forth
+#define TABLE_MIN_LOAD 0.125
+#define TABLE_MIN_CAPACITY (2 * TABLE_SMALL_MAX)
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define TABLE_SSE2
+#include <emmintrin.h>
+#endif
+
+// control bytes: full slots hold the low 7 bits of the hash of their key, so the high bit is
+// only set for empty and deleted slots
+#define CONTROL_EMPTY   ((uint8_t) 0x80)
+#define CONTROL_DELETED ((uint8_t) 0xFE)
+
+// the rest of the hash picks the group where probing starts
+static inline uint32_t hash_position(uint32_t hash) {
+    return hash >> 7;
+}
+
+static inline uint8_t hash_control(uint32_t hash) {
+    return hash & 0x7F;
+}
+
+// bit per slot of the group starting at control which holds byte
+static inline uint32_t match_byte(const uint8_t* control, uint8_t byte) {
+#ifdef TABLE_SSE2
+    __m128i group = _mm_loadu_si128((const __m128i*) control);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (control[i] == byte) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// bit per slot of the group which is empty or deleted
+static inline uint32_t match_free(const uint8_t* control) {
+#ifdef TABLE_SSE2
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*) control));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        if (control[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// entries and control bytes share an allocation
+static size_t table_size(int capacity) {
+    return sizeof(Entry) * capacity + capacity + GROUP_WIDTH - 1;
+}
+
 Table::Table() {
-    this->entries = NULL;
     this->capacity = 0;
     this->count = 0;
-    this->count_with_tombstones = 0;
 }
 
 Table::~Table() {
@@ -17,182 +71,520 @@ Table::~Table() {
 }
 
 void Table::clear() {
-    if (this->entries) {
-        FREE_ARRAY(Entry, this->entries, this->capacity);
+    if (this->capacity > 0) {
+        reallocate(this->entries, table_size(this->capacity), 0);
     }
 
-    this->entries = NULL;
     this->capacity = 0;
     this->count = 0;
-    this->count_with_tombstones = 0;
 }
 
-static Entry* find_entry_helper(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash & (capacity - 1);
-    Entry* tombstone = NULL;
+// index of key among the keys of a small table, or -1
+// the tags of all keys are compared at once, as bytes of a word, so that a miss reads no key
+static inline int find_small(ObjString* const* keys, const uint8_t* tags, int count, ObjString* key) {
+    uint64_t word;
+    memcpy(&word, tags, sizeof(word));
+    uint64_t diff = word ^ (0x0101010101010101ull * hash_control(key->hash));
+    // high bit of each byte which is zero, and maybe some above it, which comparing keys rules out
+    uint64_t bits = (diff - 0x0101010101010101ull) & ~diff & 0x8080808080808080ull;
+    if (count < TABLE_SMALL_MAX) bits &= (1ull << (8 * count)) - 1;
+
+    for (; bits != 0; bits &= bits - 1) {
+        int index = __builtin_ctzll(bits) / 8;
+        if (keys[index] == key) return index;
+    }
+    return -1;
+}
 
-    while (true) {
-        Entry* entry = &entries[index];
-        if (entry->key == key) {
-            // found
-            return entry;
-        } else if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // empty entry
-                // return prior tombstone's entry if we already found one, otherwise use this location
-                return tombstone ? tombstone : entry;
-            } else if (tombstone == NULL) {
-                // keep track of location of first tombstone found, and keep going
-                tombstone = entry;
-            }
+void Table::set_small(int index, ObjString* key, Value value) {
+    small_keys[index] = key;
+    small_values[index] = value;
+    small_tags[index] = hash_control(key->hash);
+}
+
+// Probing visits groups at triangular offsets, which covers every slot once the capacity is a
+// power of two.  Groups may start at any slot, reading past the end into the copy of the first
+// control bytes, which for capacities under GROUP_WIDTH repeats them as often as needed.
+
+void Table::set_control(int index, uint8_t byte) {
+    for (int i = index; i < capacity + GROUP_WIDTH - 1; i += capacity) {
+        control[i] = byte;
+    }
+}
+
+// index of the slot holding key, or -1
+static inline int find_index(Entry* entries, const uint8_t* control, int capacity, ObjString* key) {
+    uint32_t mask = capacity - 1;
+    uint32_t position = hash_position(key->hash) & mask;
+    // most keys are in the slot where probing starts, found without reading the group
+    if (entries[position].key == key) return position;
+    uint8_t byte = hash_control(key->hash);
+
+    for (uint32_t step = GROUP_WIDTH; ; step += GROUP_WIDTH) {
+        const uint8_t* group = &control[position];
+        for (uint32_t bits = match_byte(group, byte); bits != 0; bits &= bits - 1) {
+            uint32_t index = (position + __builtin_ctz(bits)) & mask;
+            if (entries[index].key == key) return index;
         }
-        index = (index + 1) & (capacity - 1);
+        if (match_byte(group, CONTROL_EMPTY)) return -1;
+        position = (position + step) & mask;
+    }
+}
+
+// index of the first empty or deleted slot where a key with hash would be looked for
+int Table::find_free(uint32_t hash) {
+    uint32_t mask = capacity - 1;
+    uint32_t position = hash_position(hash) & mask;
+
+    for (uint32_t step = GROUP_WIDTH; ; step += GROUP_WIDTH) {
+        uint32_t bits = match_free(&control[position]);
+        if (bits) return (position + __builtin_ctz(bits)) & mask;
+        position = (position + step) & mask;
     }
 }
 
 bool Table::get(ObjString* key, Value* out_value) {
+    if (this->capacity == 0) {
+        int index = find_small(small_keys, small_tags, count, key);
+        if (index < 0) return false;
+
+        if (out_value) *out_value = small_values[index];
+        return true;
+    }
     if (this->count == 0) return false;
 
-    Entry* entry = find_entry_helper(this->entries, this->capacity, key);
-    if (entry->key == NULL) return false;
+    int index = find_index(this->entries, this->control, this->capacity, key);
+    if (index < 0) return false;
 
-    if (out_value) *out_value = entry->value;
+    if (out_value) *out_value = entries[index].value;
     return true;
 }
 
 bool Table::set(ObjString* key, Value value) {
+    if (this->capacity == 0) {
+        int index = find_small(small_keys, small_tags, count, key);
+        if (index < 0) return false;
+
+        small_values[index] = value;
+        return true;
+    }
     if (this->count == 0) return false;
 
-    Entry* entry = find_entry_helper(this->entries, this->capacity, key);
-    if (entry->key == NULL) return false;
+    int index = find_index(this->entries, this->control, this->capacity, key);
+    if (index < 0) return false;
 
-    entry->value = value;
+    entries[index].value = value;
     return true;
 }
 
 bool Table::insert(ObjString* key, Value value) {
-    // grow table when it reaches max load
-    if (count_with_tombstones + 1 > capacity * TABLE_MAX_LOAD) {
-        int new_capacity = GROW_CAPACITY(this->capacity);
-        adjust_capacity(new_capacity);
+    if (this->capacity == 0) {
+        int index = find_small(small_keys, small_tags, count, key);
+        if (index >= 0) {
+            small_values[index] = value;
+            return false;
+        }
+        if (count < TABLE_SMALL_MAX) {
+            set_small(count, key, value);
+            count++;
+            return true;
+        }
+
+        // too many keys to scan, so start hashing
+        adjust_capacity(TABLE_MIN_CAPACITY);
     }
 
-    Entry* entry = find_entry_helper(this->entries, this->capacity, key);
-    bool is_new_key = entry->key == NULL;
-    bool is_tombstone = !IS_NIL(entry->value);
-    entry->key = key;
-    entry->value = value;
+    // look for the key, noting the first free slot on the way
+    int index = -1;
+    {
+        uint32_t mask = capacity - 1;
+        uint32_t position = hash_position(key->hash) & mask;
+        uint8_t byte = hash_control(key->hash);
+
+        for (uint32_t step = GROUP_WIDTH; ; step += GROUP_WIDTH) {
+            const uint8_t* group = &control[position];
+            for (uint32_t bits = match_byte(group, byte); bits != 0; bits &= bits - 1) {
+                Entry* entry = &entries[(position + __builtin_ctz(bits)) & mask];
+                if (entry->key == key) {
+                    entry->value = value;
+                    return false;
+                }
+            }
+            uint32_t free_bits = match_free(group);
+            if (index < 0 && free_bits != 0) index = (position + __builtin_ctz(free_bits)) & mask;
+            if (match_byte(group, CONTROL_EMPTY)) break;
+            position = (position + step) & mask;
+        }
+    }
 
-    if (is_new_key) {
-        count++;
+    // grow table when it reaches max load, or just drop the deleted slots if they are much of it
+    if (count_with_tombstones + 1 > capacity * TABLE_MAX_LOAD) {
+        bool full = count + 1 > capacity * TABLE_MAX_LOAD / 2;
+        adjust_capacity(full ? GROW_CAPACITY(this->capacity) : this->capacity);
+        index = find_free(key->hash);
     }
-    if (is_new_key || is_tombstone) {
+
+    if (control[index] == CONTROL_EMPTY) {
         count_with_tombstones++;
     }
+    set_control(index, hash_control(key->hash));
+    entries[index].key = key;
+    entries[index].value = value;
+    count++;
 
-    return is_new_key;
+    return true;
+}
+
+// insert a key known not to be in the table, which has room for it and no deleted slots
+void Table::place(ObjString* key, Value value) {
+    int index = find_free(key->hash);
+    set_control(index, hash_control(key->hash));
+    entries[index].key = key;
+    entries[index].value = value;
+    count++;
+    count_with_tombstones++;
 }
 
 int Table::insert_all(Table* from) {
     // TODO: adjust_capacity once up front?
     int result = 0;
-    for (int i = 0; i < from->capacity; i++) {
-        Entry* entry = &from->entries[i];
-        if (entry->key == NULL) continue;
-        bool is_new_key = insert(entry->key, entry->value);
+    for (int i = 0; i < from->get_slot_count(); i++) {
+        ObjString* key = from->get_key(i);
+        if (key == NULL) continue;
+        bool is_new_key = insert(key, from->get_value(i));
         if (is_new_key) result++;
     }
     return result;
 }
 
 bool Table::remove(ObjString* key) {
+    if (this->capacity == 0) {
+        int index = find_small(small_keys, small_tags, count, key);
+        if (index < 0) return false;
+
+        // keep the keys packed, moving the last into its place
+        count--;
+        set_small(index, small_keys[count], small_values[count]);
+        return true;
+    }
     if (this->count == 0) return false;
 
-    Entry* entry = find_entry_helper(this->entries, this->capacity, key);
-    return remove_entry(entry);
-}
+    int index = find_index(this->entries, this->control, this->capacity, key);
+    if (index < 0) return false;
 
-bool Table::remove_entry(Entry* entry) {
-    if (entry->key == NULL) return false;
+    remove_at(index);
+    shrink_if_sparse(count);
+    return true;
+}
 
-    // replace with tombstone
-    // note: don't decrease count_with_tombstones on delete
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+void Table::remove_at(int index) {
+    // Probes only pass a slot when it is in a group without an empty slot, so the slot can be
+    // emptied unless it is within GROUP_WIDTH slots in a row which aren't empty.  Otherwise it is
+    // marked deleted, so probes carry on past it, until the next resize drops it.
+    uint32_t mask = capacity - 1;
+    uint32_t empty_before = match_byte(&control[(index - GROUP_WIDTH) & mask], CONTROL_EMPTY);
+    uint32_t empty_after = match_byte(&control[index], CONTROL_EMPTY);
+    int full_before = empty_before ? __builtin_clz(empty_before) - (32 - GROUP_WIDTH) : GROUP_WIDTH;
+    int full_after = empty_after ? __builtin_ctz(empty_after) : GROUP_WIDTH;
+
+    if (full_before + full_after < GROUP_WIDTH) {
+        set_control(index, CONTROL_EMPTY);
+        count_with_tombstones--;
+    } else {
+        set_control(index, CONTROL_DELETED);
+    }
+    entries[index].key = NULL;
+    entries[index].value = NIL_VAL;
     count--;
+}
 
-    return true;
+// shrink unless room is needed for as many as peak keys, back to small with room for as many again
+void Table::shrink_if_sparse(int peak) {
+    if (capacity == 0 || peak >= capacity * TABLE_MIN_LOAD) return;
+    if (peak <= TABLE_SMALL_MAX / 2) {
+        adjust_capacity(0);
+        return;
+    }
+
+    int new_capacity = TABLE_MIN_CAPACITY;
+    while (peak > new_capacity * TABLE_MAX_LOAD / 2) new_capacity *= 2;
+    if (new_capacity < capacity) adjust_capacity(new_capacity);
 }
 
+// to a hashed table of new_capacity, or a small one for 0
 void Table::adjust_capacity(int new_capacity) {
-    // allocate a new entries array
-    Entry* new_entries = ALLOC_ARRAY(Entry, new_capacity);
-    for (int i = 0; i < new_capacity; i++) {
-        new_entries[i].key = NULL;
-        new_entries[i].value = NIL_VAL;
+    // move out the keys and values of a small table, as the new arrays take their place
+    int old_capacity = this->capacity;
+    int old_count = this->count;
+    Entry* old_entries = NULL;
+    ObjString* old_keys[TABLE_SMALL_MAX];
+    Value old_values[TABLE_SMALL_MAX];
+    if (old_capacity == 0) {
+        memcpy(old_keys, small_keys, sizeof(old_keys));
+        memcpy(old_values, small_values, sizeof(old_values));
+    } else {
+        old_entries = this->entries;
     }
 
-    // insert all old values into the new entries
-    // calculate new count, without any tombstones
-    int old_capacity = this->capacity;
-    int new_count = 0;
-    for (int i = 0; i < old_capacity; i++) {
-        Entry* entry = &this->entries[i];
-        if (entry->key == NULL) continue;  // also skip tombstones
+    this->capacity = new_capacity;
+    this->count = 0;
+    if (new_capacity == 0) {
+        for (int i = 0; i < old_capacity; i++) {
+            if (old_entries[i].key == NULL) continue;
+            set_small(count, old_entries[i].key, old_entries[i].value);
+            count++;
+        }
+    } else {
+        // allocate new arrays, all empty
+        this->entries = (Entry*) reallocate(NULL, 0, table_size(new_capacity));
+        this->control = (uint8_t*) (this->entries + new_capacity);
+        this->count_with_tombstones = 0;
+        memset(this->control, CONTROL_EMPTY, new_capacity + GROUP_WIDTH - 1);
+        for (int i = 0; i < new_capacity; i++) {
+            this->entries[i].key = NULL;
+            this->entries[i].value = NIL_VAL;
+        }
 
-        Entry* dest = find_entry_helper(new_entries, new_capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        new_count++;
+        // insert all old values into the new entries, dropping deleted ones
+        if (old_capacity == 0) {
+            for (int i = 0; i < old_count; i++) {
+                place(old_keys[i], old_values[i]);
+            }
+        }
+        for (int i = 0; i < old_capacity; i++) {
+            Entry* entry = &old_entries[i];
+            if (entry->key != NULL) place(entry->key, entry->value);
+        }
     }
 
     // cleanup and use only the new entries
-    FREE_ARRAY(Entry, this->entries, old_capacity);
-    this->entries = new_entries;
-    this->capacity = new_capacity;
-    this->count = new_count;
-    this->count_with_tombstones = new_count;
+    if (old_entries) {
+        reallocate(old_entries, table_size(old_capacity), 0);
+    }
 }
 
 ObjString* Table::find_string(const char* str, int length, uint32_t hash) {
+    if (capacity == 0) {
+        for (int i = 0; i < count; i++) {
+            ObjString* key = small_keys[i];
+            if (key->length == (uint32_t) length && key->hash == hash && memcmp(key->chars, str, length) == 0) {
+                return key;
+            }
+        }
+        return NULL;
+    }
     if (count == 0) return NULL;
 
-    uint32_t index = hash & (capacity - 1);
-    while (true) {
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            // could stil be tombstone
-            if (IS_NIL(entry->value)) {
-                // empty non-tombstone entry
-                return NULL;
-            }
-        } else if (entry->key->length == length && entry->key->hash == hash) {
+    uint32_t mask = capacity - 1;
+    uint32_t position = hash_position(hash) & mask;
+    uint8_t byte = hash_control(hash);
+
+    for (uint32_t step = GROUP_WIDTH; ; step += GROUP_WIDTH) {
+        const uint8_t* group = &control[position];
+        for (uint32_t bits = match_byte(group, byte); bits != 0; bits &= bits - 1) {
+            ObjString* key = entries[(position + __builtin_ctz(bits)) & mask].key;
             // length and hash match, now compare the actual string
-            if (memcmp(entry->key->chars, str, length) == 0) {
+            if (key->length == (uint32_t) length && key->hash == hash && memcmp(key->chars, str, length) == 0) {
                 // found string key
-                return entry->key;
+                return key;
             }
         }
-
-        index = (index + 1) & (capacity - 1);
+        if (match_byte(group, CONTROL_EMPTY)) return NULL;
+        position = (position + step) & mask;
     }
 }
 
 void Table::mark_objects() {
+    if (capacity == 0) {
+        for (int i = 0; i < count; i++) {
+            mark_object((Obj*) small_keys[i]);
+            mark_value(small_values[i]);
+        }
+        return;
+    }
     for (int i=0; i < capacity; i++) {
         Entry* entry = &entries[i];
         if (entry->key) {
             mark_object((Obj*) entry->key);
+            mark_value(entry->value);
         }
-        mark_value(entry->value);
     }
 }
 
 void Table::remove_unmarked_strings() {
+    // strings come and go between collections, so only shrink when there were few even before
+    int peak = count;
+    if (capacity == 0) {
+        int kept = 0;
+        for (int i = 0; i < count; i++) {
+            if (!small_keys[i]->obj.marked) continue;
+            set_small(kept, small_keys[i], small_values[i]);
+            kept++;
+        }
+        count = kept;
+        return;
+    }
     for (int i=0; i < capacity; i++) {
         Entry* entry = &entries[i];
         if (entry->key && !entry->key->obj.marked) {
-            remove_entry(entry);
+            remove_at(i);
         }
     }
+    shrink_if_sparse(peak);
+}
+
+ValueTable::ValueTable() {
+    this->entries = NULL;
+    this->capacity = 0;
+    this->count = 0;
+    this->count_with_tombstones = 0;
+}
+
+ValueTable::~ValueTable() {
+    clear();
+}
+
+void ValueTable::clear() {
+    if (this->entries) {
+        FREE_ARRAY(ValueEntry, this->entries, this->capacity);
+    }
+
+    this->entries = NULL;
+    this->capacity = 0;
+    this->count = 0;
+    this->count_with_tombstones = 0;
+}
+
+// mix all bits of a key into the low bits used to pick a slot
+static uint32_t hash_bits(uint64_t bits) {
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    bits *= 0xc4ceb9fe1a85ec53ull;
+    bits ^= bits >> 33;
+    return (uint32_t) bits;
+}
+
+// keys which are values_equal() must hash the same: strings are interned or short, and 0 equals -0
+static uint32_t hash_value(Value key) {
+    if (IS_STRING(key)) return AS_STRING(key)->hash;
+#ifdef NAN_BOXING
+    if (IS_SHORT_STRING(key)) return hash_bits(key);
+#endif
+
+    if (IS_NUMBER(key)) {
+        double number = AS_NUMBER(key);
+        if (number == 0) number = 0;
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+        return hash_bits(bits);
+    }
+
+    if (IS_OBJ(key)) return hash_bits((uint64_t) (uintptr_t) AS_OBJ(key));
+    return AS_BOOL(key) ? 1 : 0;
+}
+
+static ValueEntry* find_value_entry(ValueEntry* entries, int capacity, Value key) {
+    uint32_t index = hash_value(key) & (capacity - 1);
+    ValueEntry* tombstone = NULL;
+
+    while (true) {
+        ValueEntry* entry = &entries[index];
+        if (IS_NIL(entry->key)) {
+            if (IS_NIL(entry->value)) {
+                // empty entry
+                return tombstone ? tombstone : entry;
+            } else if (tombstone == NULL) {
+                tombstone = entry;
+            }
+        } else if (values_equal(entry->key, key)) {
+            return entry;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+bool ValueTable::get(Value key, Value* out_value) {
+    if (this->count == 0) return false;
+
+    ValueEntry* entry = find_value_entry(this->entries, this->capacity, key);
+    if (IS_NIL(entry->key)) return false;
+
+    if (out_value) *out_value = entry->value;
+    return true;
+}
+
+bool ValueTable::insert(Value key, Value value) {
+    if (count_with_tombstones + 1 > capacity * TABLE_MAX_LOAD) {
+        adjust_capacity(GROW_CAPACITY(this->capacity));
+    }
+
+    ValueEntry* entry = find_value_entry(this->entries, this->capacity, key);
+    bool is_new_key = IS_NIL(entry->key);
+    bool is_tombstone = is_new_key && !IS_NIL(entry->value);
+    entry->key = key;
+    entry->value = value;
+
+    if (is_new_key) {
+        count++;
+    }
+    if (is_new_key && !is_tombstone) {
+        count_with_tombstones++;
+    }
+
+    return is_new_key;
+}
+
+bool ValueTable::remove(Value key) {
+    if (this->count == 0) return false;
+
+    ValueEntry* entry = find_value_entry(this->entries, this->capacity, key);
+    if (IS_NIL(entry->key)) return false;
+
+    // replace with tombstone
+    entry->key = NIL_VAL;
+    entry->value = BOOL_VAL(true);
+    count--;
+
+    return true;
+}
+
+ValueEntry* ValueTable::entry(int index) {
+    ValueEntry* entry = &this->entries[index];
+    return IS_NIL(entry->key) ? NULL : entry;
+}
+
+void ValueTable::adjust_capacity(int new_capacity) {
+    ValueEntry* new_entries = ALLOC_ARRAY(ValueEntry, new_capacity);
+    for (int i = 0; i < new_capacity; i++) {
+        new_entries[i].key = NIL_VAL;
+        new_entries[i].value = NIL_VAL;
+    }
+
+    // reinsert live entries only, dropping tombstones
+    int old_capacity = this->capacity;
+    int new_count = 0;
+    for (int i = 0; i < old_capacity; i++) {
+        ValueEntry* entry = &this->entries[i];
+        if (IS_NIL(entry->key)) continue;
+
+        ValueEntry* dest = find_value_entry(new_entries, new_capacity, entry->key);
+        dest->key = entry->key;
+        dest->value = entry->value;
+        new_count++;
+    }
+
+    FREE_ARRAY(ValueEntry, this->entries, old_capacity);
+    this->entries = new_entries;
+    this->capacity = new_capacity;
+    this->count = new_count;
+    this->count_with_tombstones = new_count;
+}
+
+void ValueTable::mark_objects() {
+    for (int i = 0; i < capacity; i++) {
+        ValueEntry* entry = &entries[i];
+        mark_value(entry->key);
+        mark_value(entry->value);
+    }
 }
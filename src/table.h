@@ -5,11 +5,21 @@
 
 struct ObjString;
 
+#define GROUP_WIDTH     16
+
 struct Entry {
     ObjString* key;
     Value value;
 };
 
+// tables of up to this many keys are held inside the Table, their tags matched as a single word
+#define TABLE_SMALL_MAX 8
+
+// Table of interned strings.  Small tables, as for the fields of most instances, hold their keys
+// inline, with no probing: a byte of hash per key picks out which keys to compare.  Past TABLE_SMALL_MAX keys they become hash tables in the
+// style of SwissTable: a control byte per slot holds 7 bits of the hash of its key, or marks it
+// empty or deleted, so that a probe compares a group of 16 slots at once and only reads the keys
+// whose bits match.
 struct Table {
     Table();
     ~Table();
@@ -20,26 +30,86 @@ struct Table {
     bool set(ObjString* key, Value value);      // return true if key found, does not insert otherwise
     bool insert(ObjString* key, Value value);   // return true if key not found, always inserts or overwrites
     int insert_all(Table* from);                // return count of new keys inserted, always inserts or overwrites all keys in from
-    bool remove(ObjString* key);                // return true if key found and value removed
+    bool remove(ObjString* key);                // return true if key found and value removed, shrinks when sparse
 
     ObjString* find_string(const char* str, int length, uint32_t hash);
     void adjust_capacity(int new_capacity);
 
     void mark_objects();
-    void remove_unmarked_strings();
+    void remove_unmarked_strings();             // then shrinks when sparse since the last call
 
-    int get_capacity() { return capacity; }
+    int get_capacity() { return capacity; }    // 0 while small
     int get_count() { return count; }
-    int get_count_with_tombstones() { return count_with_tombstones; }
+    int get_count_with_tombstones() { return capacity == 0 ? count : count_with_tombstones; }
+
+    // for iterating, slots below get_slot_count() hold a key, or NULL if unused
+    int get_slot_count() { return capacity == 0 ? count : capacity; }
+    ObjString* get_key(int index) { return capacity == 0 ? small_keys[index] : entries[index].key; }
+    Value get_value(int index) { return capacity == 0 ? small_values[index] : entries[index].value; }
 
 private:
-    bool remove_entry(Entry* entry);
+    int find_free(uint32_t hash);
+    void place(ObjString* key, Value value);
+    void set_small(int index, ObjString* key, Value value);
+    void set_control(int index, uint8_t control);
+    void remove_at(int index);
+    void shrink_if_sparse(int peak);
 
-    Entry* entries;
     int capacity;
     int count;
-    int count_with_tombstones;
+    union {
+        // hashed, while capacity is set
+        struct {
+            Entry* entries;         // keys are NULL where empty or deleted
+            uint8_t* control;       // capacity bytes, then the first GROUP_WIDTH - 1 again, following entries
+            int count_with_tombstones;
+        };
+        // small, while capacity is 0, holding count keys
+        struct {
+            ObjString* small_keys[TABLE_SMALL_MAX];
+            Value small_values[TABLE_SMALL_MAX];
+            uint8_t small_tags[TABLE_SMALL_MAX];    // 7 bits of the hash of each key, as control bytes
+        };
+    };
 
     friend void print_table(Table* table);
     friend void print_strings(Table* table);
 };
+
+// entries of a ValueTable; nil keys mark empty slots and tombstones, so can't be stored
+struct ValueEntry {
+    Value key;
+    Value value;
+};
+
+// NaN is never equal to itself, so couldn't be found again
+inline static bool is_valid_key(Value key) {
+    return !IS_NIL(key) && !(IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key));
+}
+
+// hash table with keys of any value except nil and NaN, compared as by values_equal()
+struct ValueTable {
+    ValueTable();
+    ~ValueTable();
+
+    void clear();
+
+    bool get(Value key, Value* out_value);      // return true if key found
+    bool insert(Value key, Value value);        // return true if key not found, always inserts or overwrites
+    bool remove(Value key);                     // return true if key found and value removed
+
+    ValueEntry* entry(int index);               // entry at an index below capacity, or NULL if unused
+
+    void mark_objects();
+
+    int get_capacity() { return capacity; }
+    int get_count() { return count; }
+
+private:
+    void adjust_capacity(int new_capacity);
+
+    ValueEntry* entries;
+    int capacity;
+    int count;
+    int count_with_tombstones;
+};
@@ -1,6 +1,8 @@
 #include "value.h"
 #include "object.h"
 #include "memory.h"
+#include <math.h>
+#include <stdio.h>
 
 ValueArray::ValueArray() {
     this->values = NULL;
@@ -53,6 +55,26 @@ bool values_equal(Value a, Value b) {
     #endif
 }
 
+// integers are by far the most common, and much quicker to write out without snprintf
+int format_number(double number, char* buffer) {
+    if (fabs(number) < 1e10 && number == (double) (int64_t) number && !(number == 0 && signbit(number))) {
+        int64_t integer = (int64_t) number;
+        uint64_t digits = integer < 0 ? -integer : integer;
+        char reversed[NUMBER_BUFFER];
+        int count = 0;
+        do {
+            reversed[count++] = '0' + digits % 10;
+            digits /= 10;
+        } while (digits);
+
+        int length = 0;
+        if (integer < 0) buffer[length++] = '-';
+        while (count > 0) buffer[length++] = reversed[--count];
+        return length;
+    }
+    return snprintf(buffer, NUMBER_BUFFER, "%.10g", number);
+}
+
 void mark_value(Value value) {
     if (IS_OBJ(value)) {
         mark_object(AS_OBJ(value));
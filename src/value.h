@@ -52,6 +52,30 @@ static inline Value transmute_number_to_value(double number) {
     return value;
 }
 
+// Strings of up to 5 chars are held in the payload of the value itself, rather than as an
+// ObjString.  Every string value that short is held this way, so equality is comparing bits.
+// [ QNAN | tag | length: 3 bits at 40 | chars: 5 bytes ]
+#define SHORT_STRING_TAG    ((uint64_t) 0x0001000000000000)
+#define SHORT_STRING_MAX    5
+
+#define SHORT_STRING_BUFFER 8       // enough to unpack the chars of any short string
+
+#define IS_SHORT_STRING(value)      (((value) & (QNAN | SIGN_BIT | SHORT_STRING_TAG)) == (QNAN | SHORT_STRING_TAG))
+#define SHORT_STRING_LENGTH(value)  ((int) (((value) >> 40) & 7))
+
+static inline Value short_string_value(const char* chars, int length) {
+    uint64_t bits = 0;
+    memcpy(&bits, chars, length);
+    return QNAN | SHORT_STRING_TAG | ((uint64_t) length << 40) | bits;
+}
+
+// unpack into chars[SHORT_STRING_BUFFER], and return the length
+static inline int short_string_chars(Value value, char* chars) {
+    uint64_t bits = value & 0xFFFFFFFFFFull;
+    memcpy(chars, &bits, SHORT_STRING_MAX);
+    return SHORT_STRING_LENGTH(value);
+}
+
 #else
 
 struct Value {
@@ -77,6 +101,21 @@ struct Value {
 #define NUMBER_VAL(num)     ((Value){VAL_NUMBER, {.number  = num}})
 #define OBJ_VAL(ptr)        ((Value){VAL_OBJ,    {.obj     = (Obj*) ptr}})
 
+// no room for short strings, so all strings are ObjStrings
+#define SHORT_STRING_MAX    -1
+#define SHORT_STRING_BUFFER 8
+
+#define IS_SHORT_STRING(value)      false
+#define SHORT_STRING_LENGTH(value)  0
+
+static inline Value short_string_value(const char* chars, int length) {
+    return NIL_VAL;
+}
+
+static inline int short_string_chars(Value value, char* chars) {
+    return 0;
+}
+
 #endif
 
 struct ValueArray {
@@ -104,3 +143,8 @@ inline static bool is_truthy(Value value) {
 
 bool values_equal(Value a, Value b);
 void mark_value(Value value);
+
+#define NUMBER_BUFFER       32
+
+// number as printed, into buffer[NUMBER_BUFFER], returning its length
+int format_number(double number, char* buffer);
@@ -3,16 +3,18 @@
 #include "globals.h"
 #include "debug.h"
 #include "compiler.h"
+#include "optimizer.h"
 
 #include <stdio.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <math.h>
 
 #ifdef DEBUG_STRESS_GC
 #define GC_INIT_THRESHOLD   0
 #define GC_GROW_FACTOR      0
 #else
-#define GC_INIT_THRESHOLD   1024
+#define GC_INIT_THRESHOLD   16384
 #define GC_GROW_FACTOR      2
 #endif
 
@@ -23,6 +25,11 @@ VM::VM() {
     this->objects = NULL;
     this->open_upvalues = NULL;
     this->init_string = NULL;
+    this->native_error_pending = false;
+    this->call_error_pending = false;
+    this->global_dependencies = NULL;
+    this->global_dependency_count = 0;
+    this->global_dependency_capacity = 0;
     clear();
 }
 
@@ -30,6 +37,7 @@ VM::~VM() {
     this->init_string = NULL;
     reset_stack();
     free_all_objects();
+    FREE_ARRAY(GlobalDependency, global_dependencies, global_dependency_capacity);
 }
 
 InterpretResult VM::interpret(ObjFunction* main_fn) {
@@ -38,7 +46,37 @@ InterpretResult VM::interpret(ObjFunction* main_fn) {
     push(OBJ_VAL(main_fn));
     call_function(main_fn, 0);
 
-    return run();
+    InterpretResult result = run(0);
+    if (result == INTERPRET_OK) {
+        pop();  // result of main script fn
+    }
+    return result;
+}
+
+bool VM::call(Value callable, int argc, Value* args, Value* result) {
+    // args are pushed, so they remain reachable
+    Value* base = stack_top;
+    push(callable);
+    for (int i=0; i < argc; i++) {
+        push(args[i]);
+    }
+
+    int base_frame = frame_count;
+    InterpretResult status = call_value(callable, argc);
+    if (status == INTERPRET_OK && frame_count > base_frame) {
+        // run a nested loop, until the new frame returns
+        status = run(base_frame);
+    }
+
+    if (status != INTERPRET_OK) {
+        // stack was reset by the error, so make the native calling us fail too
+        call_error_pending = true;
+        return false;
+    }
+
+    *result = pop();
+    assert(stack_top == base);
+    return true;
 }
 
 void VM::reset_stack() {
@@ -49,7 +87,10 @@ void VM::reset_stack() {
 
 void VM::clear() {
     reset_stack();
+    invalidate_global_dependencies(NULL);
     this->globals.clear();
+    this->constant_names.clear();
+    this->constant_values.clear();
     define_globals(this);
     this->init_string = AS_STRING(string_value(this, "init", 4));
 }
@@ -61,9 +102,15 @@ void VM::gc() {
 
     mark_objects();
     mark_compiler_roots();
+    prune_global_dependencies();
     strings.remove_unmarked_strings();
     int freed = sweep_objects();
 
+    if (debug_mode) {
+        printf("          GC: %d freed, %d remain, strings: %d / %d\n",
+            freed, object_count, strings.get_count(), strings.get_capacity());
+    }
+
     // next threshold is minimum of GC_GROW_FACTOR * object_count and GC_INIT_THRESHOLD
     int new_threshold = object_count * GC_GROW_FACTOR;
     gc_object_threshold = new_threshold < GC_INIT_THRESHOLD ? GC_INIT_THRESHOLD : new_threshold;
@@ -129,6 +176,8 @@ void VM::mark_objects() {
 
     // globals
     globals.mark_objects();
+    constant_names.mark_objects();
+    constant_values.mark_objects();
 
     // strings
     mark_object((Obj*) init_string);
@@ -192,6 +241,89 @@ InterpretResult VM::runtime_error(const char* format, ...) {
     return INTERPRET_RUNTIME_ERROR;
 }
 
+// record an error raised by a native, reported once it returns
+// the return value is ignored, and only provided for convenience
+Value VM::native_error(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(native_error_message, sizeof(native_error_message), format, args);
+    va_end(args);
+
+    native_error_pending = true;
+    return NIL_VAL;
+}
+
+void VM::define_constant_global(ObjString* name, bool has_value, Value value) {
+    constant_names.insert(name, NIL_VAL);
+    if (has_value) {
+        constant_values.insert(name, value);
+    }
+}
+
+bool VM::get_global_once(ObjString* name, Value* value) {
+    return name->global_state == GLOBAL_ONCE && globals.get(name, value);
+}
+
+void VM::add_global_dependency(ObjString* name, ObjFunction* fn, int offset, uint8_t constant) {
+    if (global_dependency_capacity < global_dependency_count + 1) {
+        int old_capacity = global_dependency_capacity;
+        global_dependency_capacity = GROW_CAPACITY(old_capacity);
+        global_dependencies = GROW_ARRAY(GlobalDependency, global_dependencies, old_capacity, global_dependency_capacity);
+    }
+
+    GlobalDependency* dep = &global_dependencies[global_dependency_count++];
+    dep->name = name;
+    dep->fn = fn;
+    dep->offset = offset;
+    dep->constant = constant;
+}
+
+// restore OP_GET_GLOBAL wherever the value of the named global was embedded, or of all globals when NULL
+// the instructions have the same length, so frames executing the code are unaffected
+void VM::invalidate_global_dependencies(ObjString* name) {
+    int kept = 0;
+    for (int i=0; i < global_dependency_count; i++) {
+        GlobalDependency* dep = &global_dependencies[i];
+        if (name != NULL && dep->name != name) {
+            global_dependencies[kept++] = *dep;
+            continue;
+        }
+
+        if (debug_mode) {
+            printf("          Invalidating global: %s\n", dep->name->chars);
+        }
+        dep->name->global_state = GLOBAL_REASSIGNED;
+        dep->fn->chunk.code[dep->offset] = OP_GET_GLOBAL;
+        dep->fn->chunk.code[dep->offset + 1] = dep->constant;
+    }
+    global_dependency_count = kept;
+}
+
+// forget dependencies of functions about to be freed
+void VM::prune_global_dependencies() {
+    int kept = 0;
+    for (int i=0; i < global_dependency_count; i++) {
+        if (global_dependencies[i].fn->obj.marked) {
+            global_dependencies[kept++] = global_dependencies[i];
+        }
+    }
+    global_dependency_count = kept;
+}
+
+inline void VM::define_global(ObjString* name, Value value) {
+    if (globals.insert(name, value) && name->global_state == GLOBAL_UNDEFINED) {
+        name->global_state = GLOBAL_ONCE;
+    } else {
+        reassign_global(name);
+    }
+}
+
+void VM::reassign_global(ObjString* name) {
+    if (name->global_state == GLOBAL_REASSIGNED) return;
+    name->global_state = GLOBAL_REASSIGNED;
+    invalidate_global_dependencies(name);
+}
+
 inline CallFrame* VM::frame() {
     return frame_p;
 }
@@ -303,17 +435,26 @@ inline void VM::closure(Value fn) {
     for (int i=0; i < closure->upvalue_count; i++) {
         int index = read_unsigned_16();
         bool is_local = (index & 0x8000) != 0;
-        index &= 0x7FFF;
-        if (is_local) {
-            closure->upvalues[i] = capture_upvalue(index);
+        bool is_copy = (index & 0x4000) != 0;
+        index &= 0x3FFF;
+        if (is_copy) {
+            closure->upvalues[i] = frame()->values[index];
+        } else if (is_local) {
+            closure->upvalues[i] = OBJ_VAL(capture_upvalue(index));
         } else {
+            // copy from enclosing closure, whether boxed or not
             assert(frame()->closure != NULL);
             closure->upvalues[i] = frame()->closure->upvalues[index];
         }
-        assert(closure->upvalues[i] != NULL);
     }
 }
 
+// value of upvalue in current closure, which is boxed only when the variable may be reassigned
+inline Value VM::get_upvalue(int index) {
+    Value upvalue = frame()->closure->upvalues[index];
+    return IS_UPVALUE(upvalue) ? *AS_UPVALUE(upvalue)->location : upvalue;
+}
+
 inline void VM::close_upvalues(Value* last) {
     while (open_upvalues != NULL && open_upvalues->location >= last) {
         // create self-referential upvalue, so location points to value in closed
@@ -389,6 +530,143 @@ inline bool VM::get_super(ObjString* name) {
     return true;
 }
 
+// position of an element in a list or array of the given length, or -1 after reporting an error
+inline int VM::element_index(const char* kind, int length, Value index) {
+    if (!IS_NUMBER(index)) {
+        runtime_error("%s index must be a number.", kind);
+        return -1;
+    }
+    double number = AS_NUMBER(index);
+    // only cast once in range, as casting NaN, infinities and huge numbers is undefined
+    if (number != trunc(number)) {
+        runtime_error("%s index must be an integer.", kind);
+        return -1;
+    }
+    if (number < 0 || number >= length) {
+        runtime_error("%s index out of range.", kind);
+        return -1;
+    }
+    return (int) number;
+}
+
+// the interned string of a rope, slice or string, or value itself otherwise
+Value VM::flatten(Value value) {
+    if (IS_STRING(value)) return OBJ_VAL(intern_string(this, AS_STRING(value)));
+    if (IS_ROPE(value)) {
+        ObjRope* rope = AS_ROPE(value);
+        rope->flat = intern_string(this, flatten_rope(this, rope));
+        return OBJ_VAL(rope->flat);
+    }
+    if (IS_SLICE(value)) return OBJ_VAL(flatten_slice(this, AS_SLICE(value)));
+    return value;
+}
+
+// compare and pop two values, at least one of which is a rope, slice or uninterned string
+// ropes are only flattened when their lengths can't tell them apart, and the others never are
+bool VM::lazy_strings_equal() {
+    bool result = false;
+    uint32_t length;
+    if (is_string_like(peek(0)) && is_string_like(peek(1)) &&
+        (length = string_length(peek(0))) == string_length(peek(1))) {
+        // flatten while both are on the stack
+        Value b = IS_ROPE(peek(0)) ? flatten(peek(0)) : peek(0);
+        Value a = IS_ROPE(peek(1)) ? flatten(peek(1)) : peek(1);
+        char buffer_a[SHORT_STRING_BUFFER];
+        char buffer_b[SHORT_STRING_BUFFER];
+        result = values_equal(a, b) ||
+            memcmp(string_chars(a, buffer_a), string_chars(b, buffer_b), length) == 0;
+    }
+    pop_n(2);
+    return result;
+}
+
+inline bool VM::index_get() {
+    if (is_lazy_string(peek(0))) stack_top[-1] = flatten(peek(0));
+    Value target = peek(1);
+    if (IS_LIST(target)) {
+        ObjList* list = AS_LIST(target);
+        int index = element_index("List", list->items.length, peek(0));
+        if (index < 0) return false;
+        pop_n(2);
+        push(list->items.values[index]);
+        return true;
+    } else if (IS_FLOAT_ARRAY(target)) {
+        ObjFloatArray* array = AS_FLOAT_ARRAY(target);
+        int index = element_index("Array", array->length, peek(0));
+        if (index < 0) return false;
+        pop_n(2);
+        push(NUMBER_VAL(array->values[index]));
+        return true;
+    } else if (IS_MAP(target)) {
+        Value value;
+        if (!is_valid_key(peek(0))) {
+            runtime_error("Map key can't be nil or NaN.");
+            return false;
+        }
+        if (!AS_MAP(target)->table.get(peek(0), &value)) {
+            runtime_error("Undefined key.");
+            return false;
+        }
+        pop_n(2);
+        push(value);
+        return true;
+    } else if (IS_ORDERED_MAP(target)) {
+        Value value;
+        if (!is_ordered_key(peek(0))) {
+            runtime_error("Ordered map keys must be numbers or strings.");
+            return false;
+        }
+        if (!AS_ORDERED_MAP(target)->tree.get(peek(0), &value)) {
+            runtime_error("Undefined key.");
+            return false;
+        }
+        pop_n(2);
+        push(value);
+        return true;
+    }
+    runtime_error("Only lists, arrays and maps can be indexed.");
+    return false;
+}
+
+inline bool VM::index_set() {
+    if (is_lazy_string(peek(1))) stack_top[-2] = flatten(peek(1));
+    Value target = peek(2);
+    if (IS_LIST(target)) {
+        ObjList* list = AS_LIST(target);
+        int index = element_index("List", list->items.length, peek(1));
+        if (index < 0) return false;
+        list->items.values[index] = peek(0);
+    } else if (IS_FLOAT_ARRAY(target)) {
+        ObjFloatArray* array = AS_FLOAT_ARRAY(target);
+        int index = element_index("Array", array->length, peek(1));
+        if (index < 0) return false;
+        if (!IS_NUMBER(peek(0))) {
+            runtime_error("Array elements must be numbers.");
+            return false;
+        }
+        array->values[index] = AS_NUMBER(peek(0));
+    } else if (IS_MAP(target)) {
+        if (!is_valid_key(peek(1))) {
+            runtime_error("Map key can't be nil or NaN.");
+            return false;
+        }
+        AS_MAP(target)->table.insert(peek(1), peek(0));
+    } else if (IS_ORDERED_MAP(target)) {
+        if (!is_ordered_key(peek(1))) {
+            runtime_error("Ordered map keys must be numbers or strings.");
+            return false;
+        }
+        AS_ORDERED_MAP(target)->tree.insert(peek(1), peek(0));
+    } else {
+        runtime_error("Only lists, arrays and maps can be indexed.");
+        return false;
+    }
+    Value val = pop();
+    pop_n(2);
+    push(val);
+    return true;
+}
+
 inline InterpretResult VM::invoke(ObjString* name, int argc) {
     Value receiver = peek(argc);
     if (!IS_INSTANCE(receiver)) {
@@ -421,6 +699,54 @@ inline InterpretResult VM::invoke_from_class(ObjClass* klass, ObjString* name, i
     return call_value(method, argc);
 }
 
+// guarded by the receiver class, and deoptimized back to OP_INVOKE when the guard fails
+inline InterpretResult VM::invoke_cached(InlineCache* cache, int argc) {
+    Value receiver = peek(argc);
+    ObjString* name = AS_STRING(chunk()->constants.values[cache->constant]);
+
+    if (IS_INSTANCE(receiver)) {
+        ObjInstance* instance = AS_INSTANCE(receiver);
+        if (cache->klass == NULL && instance->klass->methods.get(name, &cache->method)) {
+            cache->klass = instance->klass;
+        }
+
+        // fields shadow methods, so must still check for a field
+        if (instance->klass == cache->klass && !instance->fields.get(name, NULL)) {
+            return call_value(cache->method, argc);
+        }
+    }
+
+    // deoptimize this site
+    uint8_t* ip = frame()->ip;
+    ip[-3] = OP_INVOKE;
+    ip[-2] = cache->constant;
+    return invoke(name, argc);
+}
+
+// perform a call to a trivial function without pushing a frame
+// returns false when the call must be made normally, including any errors
+inline bool VM::call_inline(ObjFunction* fn, int argc) {
+    if ((uint32_t) argc != fn->arity) return false;
+
+    switch (fn->inline_kind) {
+        case INLINE_CONSTANT: {
+            stack_top -= argc + 1;  // pop args and fn
+            push(fn->inline_value);
+            return true;
+        }
+        case INLINE_RECEIVER: {
+            stack_top -= argc;      // pop args, leaving receiver
+            return true;
+        }
+        case INLINE_GETTER: {
+            ObjInstance* instance = AS_INSTANCE(peek(0));
+            return instance->fields.get(AS_STRING(fn->inline_value), &stack_top[-1]);
+        }
+        default:
+            return false;
+    }
+}
+
 inline InterpretResult VM::call_function(ObjFunction* fn, int argc) {
     assert(fn->upvalue_count == 0);
 
@@ -431,6 +757,10 @@ inline InterpretResult VM::call_function(ObjFunction* fn, int argc) {
         return runtime_error("Stack overflow.");
     }
 
+    if (++fn->hotness == HOT_FUNCTION_THRESHOLD) {
+        optimize_function(this, fn);
+    }
+
     CallFrame* f = &frames[frame_count++];
     f->fn = fn;
     f->closure = NULL;
@@ -449,6 +779,10 @@ inline InterpretResult VM::call_closure(ObjClosure* closure, int argc) {
         return runtime_error("Stack overflow.");
     }
 
+    if (++closure->fn->hotness == HOT_FUNCTION_THRESHOLD) {
+        optimize_function(this, closure->fn);
+    }
+
     CallFrame* f = &frames[frame_count++];
     f->fn = closure->fn;
     f->closure = closure;
@@ -479,21 +813,98 @@ inline InterpretResult VM::call_bound_method(ObjBoundMethod* bound, int argc) {
     return call_value(bound->method, argc);
 }
 
+inline InterpretResult VM::call_native(ObjNative* native, int argc) {
+    if (native->arity >= 0 && argc != native->arity) {
+        return runtime_error("Expected %d arguments but got %d.", native->arity, argc);
+    }
+
+    Value* args = stack_top - argc;
+    Value result = NIL_VAL;
+    switch (native->kind) {
+        case NATIVE_VALUES:
+        case NATIVE_VIEWS:
+            // natives only see flat strings, interned except for the string natives, which may
+            // also see slices
+            for (int i = 0; i < argc; i++) {
+                if (native->kind == NATIVE_VALUES && is_lazy_string(args[i])) {
+                    args[i] = flatten(args[i]);
+                } else if (IS_ROPE(args[i])) {
+                    args[i] = OBJ_VAL(flatten_rope(this, AS_ROPE(args[i])));
+                }
+            }
+            result = native->fn.values(this, argc, args);
+            if (call_error_pending) {
+                // already reported, by a call from the native
+                call_error_pending = false;
+                reset_stack();
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (native_error_pending) {
+                native_error_pending = false;
+                return runtime_error("%s", native_error_message);
+            }
+            break;
+
+        case NATIVE_NUMBER_1:
+            if (!IS_NUMBER(args[0])) return runtime_error("Argument must be a number.");
+            result = NUMBER_VAL(native->fn.number_1(AS_NUMBER(args[0])));
+            break;
+
+        case NATIVE_NUMBER_2:
+            if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) return runtime_error("Arguments must be numbers.");
+            result = NUMBER_VAL(native->fn.number_2(AS_NUMBER(args[0]), AS_NUMBER(args[1])));
+            break;
+    }
+
+    stack_top -= argc + 1;  // pop args and fn
+    push(result);
+    return INTERPRET_OK;
+}
+
+// perform the work of a native directly, with args on the stack
+// returns false when it must be called instead, for args which aren't handled
+inline bool VM::call_intrinsic(Intrinsic intrinsic, int argc) {
+    switch (intrinsic) {
+        case INTRINSIC_CLOCK:
+            if (argc != 0) return false;
+            push(NUMBER_VAL(clock_seconds()));
+            return true;
+
+        case INTRINSIC_SQRT:
+            if (argc != 1 || !IS_NUMBER(peek(0))) return false;
+            stack_top[-1] = NUMBER_VAL(sqrt(AS_NUMBER(stack_top[-1])));
+            return true;
+
+        case INTRINSIC_FLOOR:
+            if (argc != 1 || !IS_NUMBER(peek(0))) return false;
+            stack_top[-1] = NUMBER_VAL(floor(AS_NUMBER(stack_top[-1])));
+            return true;
+
+        case INTRINSIC_ABS:
+            if (argc != 1 || !IS_NUMBER(peek(0))) return false;
+            stack_top[-1] = NUMBER_VAL(fabs(AS_NUMBER(stack_top[-1])));
+            return true;
+
+        default:
+            return false;
+    }
+}
+
 inline InterpretResult VM::call_value(Value callee, int argc) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
         case OBJ_FUNCTION: {
-            return call_function(AS_FUNCTION(callee), argc);
+            ObjFunction* fn = AS_FUNCTION(callee);
+            if (fn->inline_kind != INLINE_NONE && call_inline(fn, argc)) return INTERPRET_OK;
+            return call_function(fn, argc);
         }
         case OBJ_NATIVE: {
-            NativeFn native_fn = AS_NATIVE(callee)->native_fn;
-            Value result = native_fn(argc, stack_top - argc);
-            stack_top -= argc + 1;  // pop args and fn
-            push(result);
-            return INTERPRET_OK;
+            return call_native(AS_NATIVE(callee), argc);
         }
         case OBJ_CLOSURE: {
-            return call_closure(AS_CLOSURE(callee), argc);
+            ObjClosure* closure = AS_CLOSURE(callee);
+            if (closure->fn->inline_kind != INLINE_NONE && call_inline(closure->fn, argc)) return INTERPRET_OK;
+            return call_closure(closure, argc);
         }
         case OBJ_CLASS: {
             return call_class(AS_CLASS(callee), argc);
@@ -508,8 +919,10 @@ inline InterpretResult VM::call_value(Value callee, int argc) {
     return runtime_error("Can only call functions and classes.");
 }
 
-inline InterpretResult VM::run() {
-    if (debug_mode) {
+// run until the frame count drops back to base_frame
+// natives may call back into Lox, running a nested loop with a higher base_frame
+InterpretResult VM::run(int base_frame) {
+    if (debug_mode && base_frame == 0) {
         printf("\n== trace ==\n");
     }
 
@@ -616,6 +1029,14 @@ inline InterpretResult VM::run() {
             break;
         }
 
+        case OP_INVOKE_CACHED: {
+            InlineCache* cache = &chunk()->caches[read_byte()];
+            int argc = read_byte();
+            InterpretResult result = invoke_cached(cache, argc);
+            if (result != INTERPRET_OK) return result;
+            break;
+        }
+
         case OP_INVOKE_SUPER: {
             ObjString* name = AS_STRING(read_constant(1));
             int argc = read_byte();
@@ -656,19 +1077,19 @@ inline InterpretResult VM::run() {
 
         case OP_DEFINE_GLOBAL: {
             ObjString* name = AS_STRING(read_constant(1));
-            globals.insert(name, peek(0));
+            define_global(name, peek(0));
             pop();
             break;
         }
         case OP_DEFINE_GLOBAL_16: {
             ObjString* name = AS_STRING(read_constant(2));
-            globals.insert(name, peek(0));
+            define_global(name, peek(0));
             pop();
             break;
         }
         case OP_DEFINE_GLOBAL_24: {
             ObjString* name = AS_STRING(read_constant(3));
-            globals.insert(name, peek(0));
+            define_global(name, peek(0));
             pop();
             break;
         }
@@ -706,23 +1127,44 @@ inline InterpretResult VM::run() {
 
         case OP_SET_GLOBAL: {
             ObjString* name = AS_STRING(read_constant(1));
+            if (is_constant_global(name) && globals.get(name, NULL)) {
+                // only from code compiled before the declaration, once it has run
+                return runtime_error("Can't assign to constant variable '%s'.", name->chars);
+            }
             if (!globals.set(name, peek(0))) {
                 return runtime_error("Undefined variable '%s'.", name->chars);
             }
+            if (name->global_state != GLOBAL_REASSIGNED) {
+                reassign_global(name);
+            }
             break;
         }
         case OP_SET_GLOBAL_16: {
             ObjString* name = AS_STRING(read_constant(2));
+            if (is_constant_global(name) && globals.get(name, NULL)) {
+                // only from code compiled before the declaration, once it has run
+                return runtime_error("Can't assign to constant variable '%s'.", name->chars);
+            }
             if (!globals.set(name, peek(0))) {
                 return runtime_error("Undefined variable '%s'.", name->chars);
             }
+            if (name->global_state != GLOBAL_REASSIGNED) {
+                reassign_global(name);
+            }
             break;
         }
         case OP_SET_GLOBAL_24: {
             ObjString* name = AS_STRING(read_constant(3));
+            if (is_constant_global(name) && globals.get(name, NULL)) {
+                // only from code compiled before the declaration, once it has run
+                return runtime_error("Can't assign to constant variable '%s'.", name->chars);
+            }
             if (!globals.set(name, peek(0))) {
                 return runtime_error("Undefined variable '%s'.", name->chars);
             }
+            if (name->global_state != GLOBAL_REASSIGNED) {
+                reassign_global(name);
+            }
             break;
         }
 
@@ -760,33 +1202,33 @@ inline InterpretResult VM::run() {
 
         case OP_GET_UPVALUE: {
             int index = read_unsigned(1);
-            push(*frame()->closure->upvalues[index]->location);
+            push(get_upvalue(index));
             break;
         }
         case OP_GET_UPVALUE_16: {
             int index = read_unsigned(2);
-            push(*frame()->closure->upvalues[index]->location);
+            push(get_upvalue(index));
             break;
         }
         case OP_GET_UPVALUE_24: {
             int index = read_unsigned(3);
-            push(*frame()->closure->upvalues[index]->location);
+            push(get_upvalue(index));
             break;
         }
 
         case OP_SET_UPVALUE: {
             int index = read_unsigned(1);
-            *frame()->closure->upvalues[index]->location = peek(0);
+            *AS_UPVALUE(frame()->closure->upvalues[index])->location = peek(0);
             break;
         }
         case OP_SET_UPVALUE_16: {
             int index = read_unsigned(2);
-            *frame()->closure->upvalues[index]->location = peek(0);
+            *AS_UPVALUE(frame()->closure->upvalues[index])->location = peek(0);
             break;
         }
         case OP_SET_UPVALUE_24: {
             int index = read_unsigned(3);
-            *frame()->closure->upvalues[index]->location = peek(0);
+            *AS_UPVALUE(frame()->closure->upvalues[index])->location = peek(0);
             break;
         }
 
@@ -839,10 +1281,10 @@ inline InterpretResult VM::run() {
         }
 
         case OP_ADD: {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+            if (is_string_like(peek(0)) && is_string_like(peek(1))) {
                 Value b = peek(0);
                 Value a = peek(1);
-                Value result = concatenate_strings(this, a, b);
+                Value result = concatenate_lazily(this, a, b);
                 if (IS_NIL(result)) return runtime_error("String too long.");
                 pop();
                 pop();
@@ -878,6 +1320,10 @@ inline InterpretResult VM::run() {
             break;
         }
         case OP_EQUAL: {
+            if (is_lazy_string(peek(0)) || is_lazy_string(peek(1))) {
+                push(BOOL_VAL(lazy_strings_equal()));
+                break;
+            }
             Value b = pop();
             Value a = pop();
             bool val = values_equal(a, b);
@@ -899,6 +1345,37 @@ inline InterpretResult VM::run() {
             break;
         }
 
+        case OP_ADD_NN: {
+            double b = AS_NUMBER(pop());
+            stack_top[-1] = NUMBER_VAL(AS_NUMBER(stack_top[-1]) + b);
+            break;
+        }
+        case OP_SUBTRACT_NN: {
+            double b = AS_NUMBER(pop());
+            stack_top[-1] = NUMBER_VAL(AS_NUMBER(stack_top[-1]) - b);
+            break;
+        }
+        case OP_MULTIPLY_NN: {
+            double b = AS_NUMBER(pop());
+            stack_top[-1] = NUMBER_VAL(AS_NUMBER(stack_top[-1]) * b);
+            break;
+        }
+        case OP_DIVIDE_NN: {
+            double b = AS_NUMBER(pop());
+            stack_top[-1] = NUMBER_VAL(AS_NUMBER(stack_top[-1]) / b);
+            break;
+        }
+        case OP_LESS_NN: {
+            double b = AS_NUMBER(pop());
+            stack_top[-1] = BOOL_VAL(AS_NUMBER(stack_top[-1]) < b);
+            break;
+        }
+        case OP_GREATER_NN: {
+            double b = AS_NUMBER(pop());
+            stack_top[-1] = BOOL_VAL(AS_NUMBER(stack_top[-1]) > b);
+            break;
+        }
+
         case OP_NEGATE: {
             if (!IS_NUMBER(peek(0))) return runtime_error("Operand must be a number.");
             double val = AS_NUMBER(pop());
@@ -931,18 +1408,21 @@ inline InterpretResult VM::run() {
             Value* frame_top = frame()->values;
             close_upvalues(frame_top);
             frame_count--;
-            if (frame_count <= 0) {
-                pop();  // pop main script fn
-                return INTERPRET_OK;
-            }
-            frame_p = &frames[frame_count-1];
+            frame_p = frame_count > 0 ? &frames[frame_count-1] : NULL;
             stack_top = frame_top;
             push(result);
+            if (frame_count == base_frame) {
+                return INTERPRET_OK;
+            }
             break;
         }
         case OP_JUMP: {
             int jump = read_signed_16();
             frame()->ip += jump;
+            if (jump < 0 && ++frame()->fn->hotness == HOT_FUNCTION_THRESHOLD) {
+                // hot loop - safe to optimize, since we are at the start of a block
+                optimize_function(this, frame()->fn);
+            }
             break;
         }
         case OP_JUMP_IF_FALSE: {
@@ -965,11 +1445,69 @@ inline InterpretResult VM::run() {
             if (result != INTERPRET_OK) return result;
             break;
         }
+        case OP_INTRINSIC: {
+            Intrinsic intrinsic = (Intrinsic) read_byte();
+            int argc = read_byte();
+
+            // the callee still holds the native it was compiled for, unless reassigned
+            Value callee = peek(argc);
+            if (IS_NATIVE(callee) && AS_NATIVE(callee)->intrinsic == intrinsic && call_intrinsic(intrinsic, argc)) {
+                // replace the callee with the result
+                stack_top[-2] = stack_top[-1];
+                stack_top--;
+                break;
+            }
+
+            InterpretResult result = call_value(callee, argc);
+            if (result != INTERPRET_OK) return result;
+            break;
+        }
         case OP_CLOSE_UPVALUE: {
             close_upvalues(stack_top - 1);
             pop();
             break;
         }
+        case OP_NOP: {
+            break;
+        }
+        case OP_DUP: {
+            push(peek(0));
+            break;
+        }
+        case OP_LIST: {
+            int count = read_byte();
+            // elements stay on the stack while allocating, so they remain reachable
+            ObjList* list = new_list(this);
+            for (int i = count - 1; i >= 0; i--) {
+                list->items.write(peek(i));
+            }
+            pop_n(count);
+            push(OBJ_VAL(list));
+            break;
+        }
+        case OP_INDEX_GET: {
+            if (!index_get()) return INTERPRET_RUNTIME_ERROR;
+            break;
+        }
+        case OP_INDEX_SET: {
+            if (!index_set()) return INTERPRET_RUNTIME_ERROR;
+            break;
+        }
+        case OP_BUILD_STRING: {
+            int count = read_byte();
+            // parts stay on the stack while allocating, so they remain reachable
+            Value* parts = stack_top - count;
+            for (int i = 0; i < count; i++) {
+                if (!is_string_like(parts[i]) && !IS_NUMBER(parts[i]) && !IS_BOOL(parts[i]) && !IS_NIL(parts[i])) {
+                    return runtime_error("Can only interpolate strings, numbers, booleans and nil.");
+                }
+            }
+            Value result = build_string(this, parts, count);
+            if (IS_NIL(result)) return runtime_error("String too long.");
+            pop_n(count);
+            push(result);
+            break;
+        }
         case OP_INHERIT: {
             if (!IS_CLASS(peek(1))) return runtime_error("Superclass must be a class.");
             assert(IS_CLASS(peek(0)));
@@ -5,6 +5,7 @@
 #include "value.h"
 #include "table.h"
 #include "object.h"
+#include "regex.h"
 
 #define FRAME_MAX 64
 #define STACK_MAX 65536
@@ -22,6 +23,14 @@ struct CallFrame {
     Value* values;
 };
 
+// code where the value of a global was embedded, in place of OP_GET_GLOBAL
+struct GlobalDependency {
+    ObjString* name;
+    ObjFunction* fn;
+    int offset;
+    uint8_t constant;   // original operand, the name of the global
+};
+
 class VM {
 public:
     VM();
@@ -40,8 +49,30 @@ public:
     int get_string_capacity() { return strings.get_capacity(); }
     Table* get_strings() { return &strings; }
     Table* get_globals() { return &globals; }
+    RegexCache* get_regexes() { return &regexes; }
+
+    // globals declared with 'const', and their values when known at compile-time
+    void define_constant_global(ObjString* name, bool has_value, Value value);
+    bool is_constant_global(ObjString* name) { return constant_names.get(name, NULL); }
+    bool get_constant_global(ObjString* name, Value* value) { return constant_values.get(name, value); }
+
+    // globals assigned only once, whose values may be embedded in code until reassigned
+    bool get_global_once(ObjString* name, Value* value);
+    void add_global_dependency(ObjString* name, ObjFunction* fn, int offset, uint8_t constant);
     void clear();
 
+    // for natives
+    // push values to keep them reachable by the GC while allocating, and pop them before returning
+    // raise a runtime error with 'return vm->native_error(...);'
+    void push(Value value);
+    Value pop();
+    Value native_error(const char* format, ...);
+
+    // call any callable value from a native, running until it returns
+    // returns false after a runtime error, which has already been reported, and the native must then
+    // return immediately, without touching the stack
+    bool call(Value callable, int argc, Value* args, Value* result);
+
 private:
     void reset_stack();
     void free_all_objects();
@@ -63,30 +94,42 @@ private:
     Value read_constant(int length);
 
     Value peek(int depth);
-    void push(Value value);
-    Value pop();
     void pop_n(int n);
 
     void closure(Value fn);
     ObjUpvalue* capture_upvalue(int index);
+    Value get_upvalue(int index);
     void close_upvalues(Value* value);
+    void define_global(ObjString* name, Value value);
+    void reassign_global(ObjString* name);
+    void invalidate_global_dependencies(ObjString* name);
+    void prune_global_dependencies();
     void define_method(ObjString* name);
     bool bind_method(ObjClass* klass, ObjString* name);
     bool get_property(ObjString* name);
     bool set_property(ObjString* name);
     bool get_super(ObjString* name);
+    Value flatten(Value value);
+    bool lazy_strings_equal();
+    int element_index(const char* kind, int length, Value index);
+    bool index_get();
+    bool index_set();
 
     InterpretResult invoke(ObjString* name, int argc);
     InterpretResult invoke_super(ObjString* name, int argc);
     InterpretResult invoke_from_class(ObjClass* klass, ObjString* name, int argc);
+    InterpretResult invoke_cached(InlineCache* cache, int argc);
 
+    bool call_inline(ObjFunction* fn, int argc);
+    bool call_intrinsic(Intrinsic intrinsic, int argc);
+    InterpretResult call_native(ObjNative* native, int argc);
     InterpretResult call_function(ObjFunction* fn, int argc);
     InterpretResult call_closure(ObjClosure* closure, int argc);
     InterpretResult call_class(ObjClass* klass, int argc);
     InterpretResult call_bound_method(ObjBoundMethod* bound, int argc);
     InterpretResult call_value(Value callee, int argc);
 
-    InterpretResult run();
+    InterpretResult run(int base_frame);
 
     CallFrame frames[FRAME_MAX];
     CallFrame* frame_p;
@@ -97,12 +140,21 @@ private:
     ObjUpvalue* open_upvalues;
     Table strings;
     Table globals;
+    RegexCache regexes;
+    Table constant_names;
+    Table constant_values;
+    GlobalDependency* global_dependencies;
+    int global_dependency_count;
+    int global_dependency_capacity;
     Value stack[STACK_MAX];
     Value* stack_top;
     bool debug_mode;
+    bool native_error_pending;
+    bool call_error_pending;
+    char native_error_message[256];
     ObjString* init_string;
 
     friend Value string_value(VM* vm, const char* str, int length);
-    friend Value concatenate_strings(VM* vm, Value a, Value b);
-    friend Value define_native(VM* vm, const char* name, NativeFn fn);
+    friend ObjString* intern_string(VM* vm, ObjString* string);
+    friend Value new_native(VM* vm, const char* name, NativeKind kind, int arity);
 };
@@ -2,17 +2,32 @@
 #include "vm.h"
 #include "object.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 int dummy = 99;
 
-int main() {
+int test_hash_quality(bool verbose);
+int test_table_churn();
+
+// pass -v to also print the statistics of the hash tests
+int main(int argc, char** argv) {
+    bool verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
     printf("sizeof(Value)   = %lu\n", sizeof(Value));
     printf("sizeof(Obj)     = %lu\n", sizeof(Obj));
     printf("main            = %p\n",  main);
     printf("&dummy          = %p\n",  &dummy);
-    return 0;
+    int failures = test_table_churn();
+    failures += test_hash_quality(verbose);
+    return failures > 0 ? 1 : 0;
 }
 
+#define CHECK(condition) \
+    if (!(condition)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        return 1; \
+    }
+
 int test_tables() {
     VM vm;
     Table table;
@@ -81,3 +96,162 @@ int test_tables() {
     return 0;
 }
 
+
+// the previous string hash, for comparison
+static uint32_t hash_fnv1a(const char* key, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t) key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+// full 32-bit collisions, and mean and longest linear probe when the keys fill a table
+// of power-of-two capacity to the load where Table grows
+// returns false when worse than a uniformly random hash would be, with some allowance
+static bool check_hash(const char* name, uint32_t (*hash)(const char*, int), char** keys, int count, bool verbose) {
+    uint32_t* hashes = (uint32_t*) malloc(count * sizeof(uint32_t));
+    for (int i = 0; i < count; i++) hashes[i] = hash(keys[i], strlen(keys[i]));
+
+    int collisions = 0;
+    int capacity = 8;
+    while (count > capacity * 0.75) capacity *= 2;
+    int* slots = (int*) malloc(capacity * sizeof(int));
+    for (int i = 0; i < capacity; i++) slots[i] = -1;
+
+    long total_probes = 0;
+    int max_probes = 0;
+    for (int i = 0; i < count; i++) {
+        uint32_t index = hashes[i] & (capacity - 1);
+        int probes = 1;
+        while (slots[index] >= 0) {
+            if (hashes[slots[index]] == hashes[i]) collisions++;
+            index = (index + 1) & (capacity - 1);
+            probes++;
+        }
+        slots[index] = i;
+        total_probes += probes;
+        if (probes > max_probes) max_probes = probes;
+    }
+    double mean_probes = (double) total_probes / count;
+
+    // expected of a random hash: pairs sharing all 32 bits, and Knuth's mean for linear probing
+    double load = (double) count / capacity;
+    double expected_collisions = (double) count * (count - 1) / 2 / 4294967296.0;
+    double expected_probes = (1 + 1 / (1 - load)) / 2;
+    bool ok = collisions <= 2 * expected_collisions + 4 &&
+              mean_probes <= 1.25 * expected_probes &&
+              max_probes <= 100;
+
+    if (verbose || !ok) {
+        printf("  %-8s collisions: %-4d mean probes: %.3f  max probes: %d%s\n",
+               name, collisions, mean_probes, max_probes, ok ? "" : "  FAILED");
+    }
+    free(slots);
+    free(hashes);
+    return ok;
+}
+
+// identifier-like keys: short names with numeric suffixes, and common prefixes
+int test_hash_quality(bool verbose) {
+    const int count = 100000;
+    char** keys = (char**) malloc(count * sizeof(char*));
+    const char* formats[] = { "x%d", "field_%d", "get_%d_value", "%c%c%c" };
+    int failures = 0;
+
+    for (int f = 0; f < 4; f++) {
+        for (int i = 0; i < count; i++) {
+            keys[i] = (char*) malloc(32);
+            if (f == 3) {
+                snprintf(keys[i], 32, formats[f], 'a' + i % 26, 'a' + i / 26 % 26, 'A' + i / 676 % 64);
+            } else {
+                snprintf(keys[i], 32, formats[f], i);
+            }
+        }
+
+        // the three letter keys repeat after 26 * 26 * 64 names
+        int n = f == 3 ? 26 * 26 * 64 : count;
+        if (verbose) {
+            printf("%d keys like \"%s\"\n", n, keys[1]);
+            check_hash("fnv1a", hash_fnv1a, keys, n, true);
+        }
+        if (!check_hash("current", hash_string, keys, n, verbose)) {
+            printf("hash_string is poorly distributed over %d keys like \"%s\"\n", n, keys[1]);
+            failures++;
+        }
+
+        for (int i = 0; i < count; i++) free(keys[i]);
+    }
+
+    free(keys);
+    return failures > 0 ? 1 : 0;
+}
+
+// random inserts, removes and lookups of key_count keys, checked against which keys should be
+// present, crossing between small and hashed tables, and draining back to small at the end
+static int churn_table(int key_count, int steps) {
+    ObjString** keys = (ObjString**) malloc(key_count * sizeof(ObjString*));
+    bool* present = (bool*) calloc(key_count, sizeof(bool));
+    for (int i = 0; i < key_count; i++) {
+        char chars[32];
+        int length = snprintf(chars, sizeof(chars), "churn key %d", i);
+        keys[i] = start_string(length);
+        memcpy(keys[i]->chars, chars, length);
+        keys[i]->hash = hash_string(chars, length);
+    }
+
+    Table table;
+    int count = 0;
+    uint32_t random = 12345;
+    for (int step = 0; step < steps; step++) {
+        random = random * 1103515245 + 12345;
+        int k = (random >> 8) % key_count;
+        // bias towards inserting in the first half, and removing in the second, to grow and shrink
+        int insert_odds = step < steps / 2 ? 6 : 3;
+        int op = (random >> 24) % 10;
+
+        Value value;
+        if (op < insert_odds) {
+            CHECK(table.insert(keys[k], NUMBER_VAL(k)) == !present[k]);
+            if (!present[k]) count++;
+            present[k] = true;
+        } else if (op < 9) {
+            CHECK(table.remove(keys[k]) == present[k]);
+            if (present[k]) count--;
+            present[k] = false;
+        } else {
+            bool found = table.get(keys[k], &value);
+            CHECK(found == present[k]);
+            if (found) CHECK(AS_NUMBER(value) == k);
+            ObjString* string = table.find_string(keys[k]->chars, keys[k]->length, keys[k]->hash);
+            CHECK(string == (present[k] ? keys[k] : NULL));
+        }
+
+        CHECK(table.get_count() == count);
+        CHECK(table.get_count_with_tombstones() >= count);
+        CHECK(table.get_capacity() == 0 || table.get_count_with_tombstones() <= table.get_capacity() * 0.75);
+        CHECK(table.get_capacity() > 0 || count <= TABLE_SMALL_MAX);
+    }
+
+    for (int k = 0; k < key_count; k++) {
+        Value value;
+        CHECK(table.get(keys[k], &value) == present[k]);
+        if (present[k]) CHECK(table.remove(keys[k]));
+    }
+    CHECK(table.get_count() == 0);
+    CHECK(table.get_capacity() == 0);
+
+    for (int i = 0; i < key_count; i++) free_object((Obj*) keys[i]);
+    free(present);
+    free(keys);
+    return 0;
+}
+
+int test_table_churn() {
+    int failures = 0;
+    failures += churn_table(TABLE_SMALL_MAX + 4, 10000);
+    failures += churn_table(100, 50000);
+    failures += churn_table(5000, 200000);
+    return failures;
+}